@@ -2,16 +2,20 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <time.h>
-#include <sys/select.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/select.h>
-#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "util.h"
 #include "bios.h"
@@ -22,10 +26,16 @@
 
 	Basic idea:
 	- Each core is simulated by a pthread
-	- One POSIX timer per core thread
+	- One timerfd per core thread
 	- Core threads mask all signals except for USR1.
-	- The PIC thread receives all signals and dispatches them to
-	the right core thread by raising SIGUSR1.
+	- The PIC thread waits (with epoll) on the timerfds and the terminal
+	fds, and dispatches interrupts to the right core thread by raising
+	SIGUSR1.
+
+	In the polled delivery mode (see vm_boot), no signals are used:
+	interrupts are only posted to the pending word of the core, and are
+	dispatched when the core enables interrupts or is woken up from halt.
+	Halted cores sleep on a futex on their pending word.
 
  */
 
@@ -39,17 +49,21 @@ typedef struct core
 	interrupt_handler* bootfunc;
 	pthread_t thread;
 
-	struct sigevent timer_sigevent;
-	timer_t timer_id;
+	int timer_fd;
 
 	interrupt_handler* intvec[maximum_interrupt_no];
-	sig_atomic_t intpending[maximum_interrupt_no];
+	uint intpending;	/* bit i is set iff interrupt i is pending */
+	uint serial_pending[2];	/* bit i is set iff serial port i raised 
+							   SERIAL_RX_READY (resp. SERIAL_TX_READY) */
 
 	sig_atomic_t int_disabled;
 	sig_atomic_t halted;
 	rlnode halted_node;
 	pthread_cond_t halt_cond;
 
+	/* Calls to cpu_relax() since the core last gave up its host CPU */
+	uint relax_count;
+
 	/* Statistics */
 	int irq_count;
 	int irq_raised[maximum_interrupt_no];
@@ -66,18 +80,29 @@ static sigset_t core_signal_set;
 /* Uset to store the singleton set containing SIGUSR1 */
 static sigset_t sigusr1_set;
 
-/* Uset to store the singleton set containing SIGALRM */
-static sigset_t sigalrm_set;
-
-/* Used to create the signalfd */
-static sigset_t signalfd_set;
-
-/* Array of Core objects, one per core */
-static Core CORE[MAX_CORES];
+/* Array of Core objects, one per core, allocated by vm_boot */
+static Core* CORE = NULL;
 
 /* Number of cores */
 static unsigned int ncores = 0;
 
+/* Interrupt delivery mode: if set, the pending words are polled, else SIGUSR1 is used */
+static int irq_polled = 0;
+
+/* A pseudo-interrupt bit of the pending word, set to restart a halted core */
+#define CORE_RESTART_BIT (1u << 31)
+#define INTERRUPT_BITS ((1u << maximum_interrupt_no) - 1)
+
+static inline void futex_wait(uint* addr, uint val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void futex_wake(uint* addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
 /* Core barrier */
 static pthread_barrier_t system_barrier, core_barrier;
 
@@ -90,9 +115,6 @@ static pthread_mutex_t core_halt_mutex = PTHREAD_MUTEX_INITIALIZER;
 /* List of halted cores */
 static rlnode halted_list;
 
-/* PIC thread id */
-static pthread_t PIC_thread;
-
 /* Save the sigaction for SIGUSR1 */
 static struct sigaction USR1_saved_sigaction;
 
@@ -113,8 +135,14 @@ static volatile coarse_clock_t  system_clock;
 static void sigusr1_handler(int signo, siginfo_t* si, void* ctx);
 
 
+/* The epoll instance of the PIC daemon */
+static int PIC_epollfd;
+
+/* An eventfd, written to wake up the PIC daemon */
+static int PIC_wakeupfd;
+
 /* PIC daemon statistics */
-static unsigned long PIC_loops, PIC_usr1_drained, PIC_usr1_queued;
+static unsigned long PIC_loops, PIC_wakeups_drained, PIC_wakeups_queued;
 
 
 /* Initialize static vars. This is called via pthread_once() */
@@ -136,15 +164,6 @@ static void initialize()
 	CHECK(sigemptyset(&sigusr1_set));
 	CHECK(sigaddset(&sigusr1_set, SIGUSR1));
 
-	/* Create the mask for  SIGALRM */
-	CHECK(sigemptyset(&sigalrm_set));
-	CHECK(sigaddset(&sigalrm_set, SIGALRM));
-
-
-	/* Create signaldf_set */
-	CHECK(sigemptyset(&signalfd_set));
-	CHECK(sigaddset(&signalfd_set, SIGUSR1));
-	CHECK(sigaddset(&signalfd_set, SIGALRM));
 }
 
 
@@ -167,11 +186,9 @@ static inline Core* curr_core() {
  */
 static inline void interrupt_pic_thread()
 {
-	union sigval coreval;
-	coreval.sival_ptr = NULL; /* This is silly, but silences valgrind */
-	coreval.sival_int = -1;
-	CHECKRC(pthread_sigqueue(PIC_thread, SIGUSR1, coreval));
-	__atomic_fetch_add(&PIC_usr1_queued,1,__ATOMIC_RELAXED);
+	uint64_t one = 1;
+	CHECK(write(PIC_wakeupfd, &one, sizeof(one)));
+	__atomic_fetch_add(&PIC_wakeups_queued,1,__ATOMIC_RELAXED);
 }
 
 
@@ -184,10 +201,10 @@ static void* bootfunc_wrapper(void* _core)
 	Core* core = (Core*)_core;
 
 	/* Default interrupt handlers */
-	for(int i=0; i<maximum_interrupt_no; i++) {
+	for(int i=0; i<maximum_interrupt_no; i++)
 		core->intvec[i] = NULL;
-		core->intpending[i] = 0;
-	}
+	core->intpending = 0;
+	core->serial_pending[0] = core->serial_pending[1] = 0;
 
 	/* Mark interrupts as enabled */
 	core->int_disabled = 0;
@@ -199,12 +216,6 @@ static void* bootfunc_wrapper(void* _core)
 	/* Set core signal mask */
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &core_signal_set, NULL));
 
-	/* create a thread-specific timer */
-	core->timer_sigevent.sigev_notify = SIGEV_SIGNAL;
-	core->timer_sigevent.sigev_signo = SIGALRM;
-	core->timer_sigevent.sigev_value.sival_int = core->id;
-	CHECK(timer_create(CLOCK_REALTIME, & core->timer_sigevent, & core->timer_id));
-
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
 
@@ -216,8 +227,8 @@ static void* bootfunc_wrapper(void* _core)
 		core->intvec[i] = NULL;
 	}		
 
-	/* Delete the core timer */
-	CHECK(timer_delete(core->timer_id));
+	/* Stop the core timer */
+	bios_cancel_timer();
 
 	pthread_barrier_wait(& core_barrier);
 
@@ -234,16 +245,35 @@ static void* bootfunc_wrapper(void* _core)
 }
 
 
+/*
+	Wake up a core from halt in the polled mode, by posting bits to its 
+	pending word. The halted flag is checked after the bits are posted, 
+	while the core checks the pending word after it sets the flag, so 
+	one of the two always sees the other.
+ */
+static inline void core_post(Core* core, uint bits)
+{
+	__atomic_fetch_or(&core->intpending, bits, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&core->halted, __ATOMIC_SEQ_CST))
+		futex_wake(&core->intpending);
+}
+
+
 /*
 	Raise an interrupt to a core.
  */
 static inline void raise_interrupt(Core* core, Interrupt intno) 
 {
+	core->irq_raised[intno] ++;
+	if(irq_polled) {
+		core_post(core, 1u << intno);
+		return;
+	}
+
 	union sigval coreval;
 	coreval.sival_ptr = NULL; /* This is to silence valgrind */
 	coreval.sival_int = core->id;
-	core->intpending[intno] = 1;
-	core->irq_raised[intno] ++;
+	__atomic_fetch_or(&core->intpending, 1u << intno, __ATOMIC_SEQ_CST);
 	CHECKRC(pthread_sigqueue(core->thread, SIGUSR1, coreval));
 	cpu_core_restart(core->id);
 }
@@ -254,18 +284,19 @@ static inline void raise_interrupt(Core* core, Interrupt intno)
  */
 static void dispatch_interrupts(Core* core)
 {
-	for(int intno = 0; intno < maximum_interrupt_no; intno++) {
-		if(core->int_disabled) break; /* will continue at
-										 cpu_interrupt_enable()*/
-		if(core->intpending[intno]) {
-			core->intpending[intno] = 0;
-			core->irq_delivered[intno]++;
-			interrupt_handler* handler =  core->intvec[intno];
-			if(handler != NULL) { 
-				handler();
-			}
+	while(! core->int_disabled) {  /* else, will continue at cpu_interrupt_enable()*/
+		uint pending = __atomic_load_n(&core->intpending, __ATOMIC_ACQUIRE) & INTERRUPT_BITS;
+		if(pending == 0) break;
+
+		/* Lower interrupt numbers go first */
+		int intno = __builtin_ctz(pending);
+		__atomic_fetch_and(&core->intpending, ~(1u << intno), __ATOMIC_ACQ_REL);
+		core->irq_delivered[intno]++;
+		interrupt_handler* handler =  core->intvec[intno];
+		if(handler != NULL) { 
+			handler();
 		}
-	}	
+	}
 }
 
 
@@ -311,13 +342,18 @@ static coarse_clock_t get_coarse_time()
 	by this program (bidirectional fds, such as sockets, can be handled by a pair of
 	io_device objects).  
 
-	An io_device is ready if I/O operations may succeed (as reported by select()).
+	An io_device is ready if I/O operations may succeed.
 
-	A not-ready device is made ready when select() returns it as such.
+	A not-ready device is made ready when epoll() reports an edge on its fd 
+	(the fds are registered edge-triggered).
 
 	A ready device is made not-ready on each failed attempt to do an I/O transfer.
 
 	When a not-ready device becomes ready, an interrupt is raised.
+
+	An edge may arrive between a failed transfer and the marking of the device
+	as not-ready; then, the PIC sees a ready device and raises no interrupt.
+	Therefore, a transfer that turns a ready device to not-ready is retried once.
  */
 
 typedef enum io_direction
@@ -333,6 +369,7 @@ typedef struct io_device
 {
 	int fd;              		/* file descriptor */
 	io_direction iodir;  		/* device direction */
+	uint port;					/* the serial port of the device */
 
 	volatile Core* int_core;		/* core to receive interrupts */
 	volatile int ready;  		/* ready flag */
@@ -349,10 +386,11 @@ static int io_ready(int fd, io_direction dir) {
 	return (pfd.revents & evt) ? 1 : 0;
 }
 
-static void io_device_init(io_device* this, int fd, io_direction iodir)
+static void io_device_init(io_device* this, int fd, io_direction iodir, uint port)
 {
 	this->fd = fd;
 	this->iodir = iodir;
+	this->port = port;
 	this->int_core = &CORE[0];
 	this->ready = io_ready(fd, iodir);
 	this->last_int = system_clock;
@@ -362,37 +400,67 @@ static void io_device_init(io_device* this, int fd, io_direction iodir)
 }
 
 
-static int io_device_read(io_device* this, char* ptr)
+/* Try an I/O transfer of up to 'size' bytes, return the number of bytes transferred */
+static uint io_device_transfer(io_device* this, char* ptr, uint size)
 {
-	assert(this->iodir == IODIR_RX);
-	int rc;
-	while((rc=read(this->fd, ptr, 1))==-1 && errno == EINTR);
-	assert(rc==0 || rc==1 || (rc==-1 && (errno==EAGAIN || errno==EWOULDBLOCK)));
+	ssize_t rc;
+	if(this->iodir == IODIR_RX)
+		while((rc=read(this->fd, ptr, size))==-1 && errno == EINTR);
+	else
+		while((rc=write(this->fd, ptr, size))==-1 && errno == EINTR);
+
+	assert(rc>=0 || (rc==-1 && (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE)));
+	return (rc>0) ? rc : 0;
+}
 
-	if(rc!=1 && this->ready) {
-		this->ready = 0;
-		interrupt_pic_thread();
+static uint io_device_try(io_device* this, char* ptr, uint size)
+{
+	uint rc = io_device_transfer(this, ptr, size);
+	if(rc) return rc;
+
+	/* Become not-ready, and retry if we were ready (see above) */
+	if(__atomic_exchange_n(&this->ready, 0, __ATOMIC_SEQ_CST) 
+		&& (rc = io_device_transfer(this, ptr, size))) {
+		__atomic_store_n(&this->ready, 1, __ATOMIC_SEQ_CST);
+		return rc;
 	}
-	return rc==1;
+	return 0;
 }
 
+static uint io_device_read(io_device* this, char* ptr, uint size)
+{
+	assert(this->iodir == IODIR_RX);
+	return io_device_try(this, ptr, size);
+}
 
-static int io_device_write(io_device* this, char value)
+
+static uint io_device_write(io_device* this, const char* ptr, uint size)
 {
 	assert(this->iodir == IODIR_TX);
+	return io_device_try(this, (char*) ptr, size);
+}
 
-	/* Try to write */
-	int rc;
-	while((rc = write(this->fd, &value, 1))==-1 && errno == EINTR);
 
-	assert(rc==1 || (rc==-1 && (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE))); 
+/*
+	Raise the device's interrupt, marking the serial port as pending
+	on the receiving core, for bios_serial_pending().
+ */
+static void io_device_interrupt(io_device* this, Interrupt intno)
+{
+	Core* core = (Core*) this->int_core;
+	__atomic_fetch_or(&core->serial_pending[intno-SERIAL_RX_READY], 1u << this->port, __ATOMIC_SEQ_CST);
+	raise_interrupt(core, intno);
+}
 
-	if(rc!=1 && this->ready) {
-		this->ready = 0;
-		interrupt_pic_thread();
-	} 
 
-	return rc==1;
+/*
+	Called by the PIC daemon when epoll reports an edge on the device fd.
+ */
+static void io_device_edge(io_device* this, Interrupt intno)
+{
+	this->last_int = system_clock;
+	if(! __atomic_exchange_n(&this->ready, 1, __ATOMIC_SEQ_CST))
+		io_device_interrupt(this, intno);
 }
 
 
@@ -421,12 +489,12 @@ static int terminal_init(terminal* this, int no)
 	sprintf(fname, "con%d", no);
 	fd = open(fname, O_WRONLY);
 	if(fd==-1) return -1;
-	io_device_init(& this->con, fd, IODIR_TX);
+	io_device_init(& this->con, fd, IODIR_TX, no);
 
 	sprintf(fname, "kbd%d", no);
 	fd = open(fname, O_RDONLY);
 	if(fd==-1) return -1;
-	io_device_init(& this->kbd, fd, IODIR_RX);
+	io_device_init(& this->kbd, fd, IODIR_RX, no);
 
 	return 0;
 }
@@ -456,40 +524,39 @@ static void close_terminal(terminal* term)
 {
 	CHECK(terminal_destroy(term));
 }
-static inline void fdset_add(fd_set* set, int fd, int* nfds)
-{
-	FD_SET(fd, set);
-	if(fd >= *nfds) *nfds = fd+1;
-}
 
 
-static int check_terminal(terminal* term)
+/* Helper for PIC_daemon */
+static void pic_drain_wakeups()
 {
-	/* poll the read side */
-	struct pollfd fds = { .fd=term->kbd.fd, .events=POLLIN };
-	int rc;
-	while( (rc=poll(&fds, 1, 0)) == -1 && errno==EINTR );
-	CHECK(rc);
-	return (fds.revents & (POLLHUP|POLLERR))==0;
+	uint64_t count;
+	int rc = read(PIC_wakeupfd, &count, sizeof(count));
+	if(rc==-1) {
+		assert(errno==EAGAIN || errno==EWOULDBLOCK);
+		return;
+	}
+	assert(rc==sizeof(count));
+	__atomic_fetch_add(&PIC_wakeups_drained,count,__ATOMIC_RELAXED);
 }
 
 
+/* 
+	The sources of PIC events. The epoll data of each fd holds its source
+	and the number of the core or terminal.
+ */
+enum pic_source { PIC_WAKEUP, PIC_TIMER, PIC_SERIAL_RX, PIC_SERIAL_TX };
 
-/* Helper for PIC_daemon */
-static void pic_drain_sigusr1(int sigusr1fd)
-{
-	struct signalfd_siginfo sfdinfo;
-	while(1) {
-		int rc = read(sigusr1fd, &sfdinfo, sizeof(sfdinfo));
-		if(rc==-1) {
-			assert(errno==EAGAIN || errno==EWOULDBLOCK);
-			break;
-		}
-		assert(rc==sizeof(sfdinfo));
-		__atomic_fetch_add(&PIC_usr1_drained,1,__ATOMIC_RELAXED);
-	}				
+#define PIC_EVENT_DATA(src, no)  ((((uint64_t)(src)) << 32) | (no))
+
+static void pic_add_fd(int fd, uint32_t events, enum pic_source src, uint no)
+{
+	struct epoll_event evt = { .events = events, .data.u64 = PIC_EVENT_DATA(src, no) };
+	CHECK(epoll_ctl(PIC_epollfd, EPOLL_CTL_ADD, fd, &evt));
 }
 
+/* The maximum number of events per epoll_wait(); more are returned by the next call */
+#define PIC_MAX_EVENTS 64
+
 
 /*
 	The PIC daemon is the dispatcher on interrupts to core threads,
@@ -513,97 +580,86 @@ static void PIC_daemon(uint serialno)
 	CHECKRC(pthread_getname_np(pthread_self(), oldname, 16));
 	CHECKRC(pthread_setname_np(pthread_self(), "tinyos_vm"));
 
-	for(uint i=0; i<nterm; i++)
-		open_terminal(& TERM[i], i);
+	/* Create the epoll instance and register all event sources */
+	PIC_epollfd = epoll_create1(EPOLL_CLOEXEC);
+	CHECK(PIC_epollfd);
 
-	sigset_t saved_mask;
+	PIC_wakeupfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	CHECK(PIC_wakeupfd);
+	pic_add_fd(PIC_wakeupfd, EPOLLIN, PIC_WAKEUP, 0);
 
-	int sigusr1fd = signalfd(-1, &sigusr1_set, SFD_NONBLOCK);
-	CHECK(sigusr1fd);
-	int sigalrmfd = signalfd(-1, &sigalrm_set, SFD_NONBLOCK);
-	CHECK(sigalrmfd);
+	for(uint c=0; c<ncores; c++) {
+		CORE[c].timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		CHECK(CORE[c].timer_fd);
+		pic_add_fd(CORE[c].timer_fd, EPOLLIN, PIC_TIMER, c);
+	}
 
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &signalfd_set, &saved_mask));
+	for(uint i=0; i<nterm; i++) {
+		open_terminal(& TERM[i], i);
+		pic_add_fd(TERM[i].kbd.fd, EPOLLIN | EPOLLET, PIC_SERIAL_RX, i);
+		pic_add_fd(TERM[i].con.fd, EPOLLOUT | EPOLLET, PIC_SERIAL_TX, i);
+	}
+
+	/* Interrupts are only for core threads */
+	sigset_t saved_mask;
+	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, &saved_mask));
 		
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
 	
 	/* The PIC multiplexing loop */
 	while(__atomic_load_n(&PIC_active, __ATOMIC_ACQUIRE)) {
-		int maxfd = 0;
-		fd_set readfds, writefds;
+		struct epoll_event events[PIC_MAX_EVENTS];
 
-		/* Prepare to select */
-		FD_ZERO(&readfds);
-		FD_ZERO(&writefds);
-
-		for(uint i=0; i<nterm; i++) {
-			terminal* term = & TERM[i];
-			if(!check_terminal(term)) continue;
-			if(! term->kbd.ready) fdset_add(&readfds, term->kbd.fd, &maxfd);
-			if(! term->con.ready) fdset_add(&writefds, term->con.fd, &maxfd);
-		}
-
-		fdset_add(&readfds, sigalrmfd, &maxfd);
-		fdset_add(&readfds, sigusr1fd, &maxfd);
-
-		/* select will sleep for about SLOW_HZ usec (half the system_clock res.) */
-		struct timeval sleeptime = { .tv_sec=0, .tv_usec = SLOW_HZ };
-		int selcode = select(maxfd, &readfds, &writefds, NULL, &sleeptime);
+		/* epoll will sleep for at most SLOW_HZ usec (half the system_clock res.) */
+		int nevents = epoll_wait(PIC_epollfd, events, PIC_MAX_EVENTS, SLOW_HZ/1000);
 
 		/* update system clock */
 		system_clock = get_coarse_time();
 
 		/* process */
-		if(selcode<0) continue;
+		if(nevents<0) { assert(errno==EINTR); continue; }
 		__atomic_fetch_add(&PIC_loops,1,__ATOMIC_RELAXED);
 
-		/* First raise ALRM as needed (timers have priority :-) */
-		if( FD_ISSET(sigalrmfd, &readfds) ) {
-			struct signalfd_siginfo sfdinfo;
-
-			while(1) {
-				int rc = read(sigalrmfd, &sfdinfo, sizeof(sfdinfo));
-				if(rc==-1) {
-					assert(errno==EAGAIN || errno==EWOULDBLOCK);
-					break;
-				}
-				assert(rc==sizeof(sfdinfo));
-
-				Core* core = & CORE[sfdinfo.ssi_int];
-				raise_interrupt(core, ALARM);
+		for(int e=0; e<nevents; e++) {
+			uint no = (uint) events[e].data.u64;
+
+			switch(events[e].data.u64 >> 32) {
+			case PIC_TIMER: {
+				/* The timer may have been reset after it expired, then
+				   there is nothing to read and no interrupt to raise */
+				uint64_t expirations;
+				if(read(CORE[no].timer_fd, &expirations, sizeof(expirations))==sizeof(expirations))
+					raise_interrupt(&CORE[no], ALARM);
+				break;
+			}
+			case PIC_WAKEUP:
+				/* The purpose was just to unblock the PIC from epoll */
+				pic_drain_wakeups();
+				break;
+			case PIC_SERIAL_RX:
+				io_device_edge(& TERM[no].kbd, SERIAL_RX_READY);
+				break;
+			case PIC_SERIAL_TX:
+				io_device_edge(& TERM[no].con, SERIAL_TX_READY);
+				break;
 			}
 		}
 
-		/* Discard any USR1 signals to PIC (their purpose was to unblock PIC 
-		   from select) */
-		if( FD_ISSET(sigusr1fd, &readfds) ) {
-			pic_drain_sigusr1(sigusr1fd);
-		}
-
-		/* Handle the devices */
+		/* Handle the device timeouts */
 		for(uint i=0; i<nterm; i++) {
-
 			terminal* term = & TERM[i];
-			if( FD_ISSET(term->con.fd, &writefds) 
-				|| (system_clock-term->con.last_int)>SERIAL_TIMEOUT
-				) 
-			{
+
+			if((system_clock-term->con.last_int)>SERIAL_TIMEOUT) {
 				term->con.ready = 1;
 				term->con.last_int = system_clock;
-				Core* core = (Core*) term->con.int_core;
-				raise_interrupt(core, SERIAL_TX_READY);
+				io_device_interrupt(& term->con, SERIAL_TX_READY);
 			}
 
-
-			if( FD_ISSET(term->kbd.fd, &readfds) 
-				|| (system_clock-term->kbd.last_int)>SERIAL_TIMEOUT
-				) 
-			{
+			if((system_clock-term->kbd.last_int)>SERIAL_TIMEOUT) {
 				term->kbd.ready = 1;
 				term->kbd.last_int = system_clock;
-				Core* core = (Core*) term->kbd.int_core;
-				raise_interrupt(core, SERIAL_RX_READY);
+				io_device_interrupt(& term->kbd, SERIAL_RX_READY);
 			}
 		}
 	}
@@ -611,10 +667,12 @@ static void PIC_daemon(uint serialno)
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
 
-	/* Close signal fds */
-	pic_drain_sigusr1(sigusr1fd);
-	CHECK(close(sigalrmfd));
-	CHECK(close(sigusr1fd));
+	/* Close the event sources */
+	pic_drain_wakeups();
+	for(uint c=0; c<ncores; c++)
+		CHECK(close(CORE[c].timer_fd));
+	CHECK(close(PIC_wakeupfd));
+	CHECK(close(PIC_epollfd));
 
 	/* Restore sigmask */
 	CHECKRC(pthread_sigmask(SIG_SETMASK, &saved_mask, NULL));
@@ -639,21 +697,104 @@ static void PIC_daemon(uint serialno)
 	CPU functions.
  */
 
+/*
+	Parse a list of host CPUs, such as "0-3,8,10-11", into 'cpus'.
+	Return the number of CPUs in the list, or 0 on a syntax error.
+ */
+static uint parse_cpu_list(const char* spec, int* cpus, uint maxcpus)
+{
+	uint n = 0;
+	const char* p = spec;
+	while(*p) {
+		char* end;
+		long lo = strtol(p, &end, 10);
+		if(end==p || lo<0) return 0;
+		long hi = lo;
+		if(*end=='-') {
+			p = end+1;
+			hi = strtol(p, &end, 10);
+			if(end==p || hi<lo) return 0;
+		}
+		for(long cpu=lo; cpu<=hi && n<maxcpus; cpu++)
+			cpus[n++] = cpu;
+		if(*end==',') end++;
+		else if(*end!='\0') return 0;
+		p = end;
+	}
+	return n;
+}
+
+
+/*
+	Build the affinity map from the TINYOS_AFFINITY environment variable,
+	into 'cpumap' (of size 'cores'). Return 0 if the cores are not to be pinned.
+ */
+static int affinity_from_env(int* cpumap, uint cores, cpu_set_t* host_cpus)
+{
+	const char* spec = getenv("TINYOS_AFFINITY");
+	if(spec==NULL || *spec=='\0' || strcmp(spec, "none")==0)
+		return 0;
+
+	if(strcmp(spec, "compact")==0) {
+		/* Core c on the c-th cpu we may run on, wrapping around */
+		int cpus[CPU_SETSIZE];
+		uint ncpus = 0;
+		for(int cpu=0; cpu<CPU_SETSIZE; cpu++)
+			if(CPU_ISSET(cpu, host_cpus)) cpus[ncpus++] = cpu;
+		CHECK_CONDITION(ncpus > 0);
+		for(uint c=0; c<cores; c++) cpumap[c] = cpus[c % ncpus];
+		return 1;
+	}
+
+	/* An explicit list of cpus, assigned to the cores in order, wrapping around */
+	int cpus[CPU_SETSIZE];
+	uint ncpus = parse_cpu_list(spec, cpus, CPU_SETSIZE);
+	if(ncpus==0)
+		FATAL("Bad value of TINYOS_AFFINITY (expected 'none', 'compact' or a list of cpus)");
+	for(uint c=0; c<cores; c++) cpumap[c] = cpus[c % ncpus];
+	return 1;
+}
+
+
 void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
+{
+	vm_boot_ex(bootfunc, cores, serialno, NULL);
+}
+
+
+void vm_boot_ex(interrupt_handler bootfunc, uint cores, uint serialno, const int* cpumap)
 {
 
 	CHECK_CONDITION(cores > 0 && cores <= MAX_CORES);
 	CHECK_CONDITION(ncores==0);
 	CHECK_CONDITION(serialno <= MAX_TERMINALS);
 
+	/* Allocate the core table */
+	CORE = calloc(cores, sizeof(Core));
+	CHECK_CONDITION(CORE != NULL);
+
+	/* Determine the core to host cpu map */
+	cpu_set_t host_cpus;
+	CHECK(sched_getaffinity(0, sizeof(host_cpus), &host_cpus));
+	int* env_cpumap = NULL;
+	if(cpumap == NULL) {
+		env_cpumap = malloc(cores*sizeof(int));
+		CHECK_CONDITION(env_cpumap != NULL);
+		if(affinity_from_env(env_cpumap, cores, &host_cpus))
+			cpumap = env_cpumap;
+	}
+
 	/* This is called only once in the life of the process. */
 	CHECKRC(pthread_once(&init_control, initialize));
 
+	/* Select the interrupt delivery mode */
+	const char* irqmode = getenv("TINYOS_IRQ");
+	irq_polled = (irqmode != NULL && strcmp(irqmode, "polled") == 0);
+
 	/* Install signal handler for SIGUSR1 */
 	CHECK(sigaction(SIGUSR1, &USR1_sigaction, &USR1_saved_sigaction));
 
 	/* Set pic_active to 1 */
-	PIC_thread = pthread_self();
 	PIC_active = 1;	
 
 	/* Initialize system_clock */
@@ -684,15 +825,26 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 			CORE[c].irq_raised[intno] = 0;
 		}
 
-		/* Create the core thread */
-		CHECKRC(pthread_create(& CORE[c].thread, NULL, bootfunc_wrapper, &CORE[c]));
+		/* Create the core thread, pinned to a host cpu if so requested */
+		pthread_attr_t attr;
+		CHECKRC(pthread_attr_init(&attr));
+		if(cpumap != NULL && cpumap[c] >= 0) {
+			CHECK_CONDITION(cpumap[c] < CPU_SETSIZE && CPU_ISSET(cpumap[c], &host_cpus));
+			cpu_set_t cpuset;
+			CPU_ZERO(&cpuset);
+			CPU_SET(cpumap[c], &cpuset);
+			CHECKRC(pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset));
+		}
+		CHECKRC(pthread_create(& CORE[c].thread, &attr, bootfunc_wrapper, &CORE[c]));
+		CHECKRC(pthread_attr_destroy(&attr));
 		char thread_name[16];
 		CHECK(snprintf(thread_name,16,"core-%d",c));
 		CHECKRC(pthread_setname_np(CORE[c].thread, thread_name));
 	}
+	free(env_cpumap);
 
 	/* Initialize PIC statistics */
-	PIC_loops = 0; PIC_usr1_queued = PIC_usr1_drained = 0;
+	PIC_loops = 0; PIC_wakeups_queued = PIC_wakeups_drained = 0;
 
 	/* Run the interrupt controller daemon on this thread */	
 	PIC_daemon(serialno);
@@ -709,13 +861,13 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 	/* Restore signal mask before VM execution */
 	CHECK(sigaction(SIGUSR1, &USR1_saved_sigaction, NULL));
 
-	/* Delete the Core table */
+	/* Delete the Core table (it is freed below) */
 	ncores = 0;
 
 	/* emit statistics */
 #if 0
 	fprintf(stderr,"PIC loops: %lu  queued/drained= %lu / %lu\n", 
-		PIC_loops, PIC_usr1_queued, PIC_usr1_drained);
+		PIC_loops, PIC_wakeups_queued, PIC_wakeups_drained);
 	for(uint c=0;c<cores;c++) {
 		fprintf(stderr,"Core %3d: irq_count=%6d. deliv(raised):\t",
 			c, CORE[c].irq_count);
@@ -724,6 +876,9 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 		fprintf(stderr,"\n");
 	}
 #endif
+
+	free(CORE);
+	CORE = NULL;
 }
 
 
@@ -732,11 +887,31 @@ uint cpu_cores()
 	return ncores;
 }
 
+/* 
+	Halt in the polled mode: sleep on the pending word, until an interrupt
+	or a restart is posted to it.
+ */
+static void core_halt_polled(Core* core)
+{
+	__atomic_store_n(&core->halted, 1, __ATOMIC_SEQ_CST);
+	uint pending;
+	while((pending = __atomic_load_n(&core->intpending, __ATOMIC_SEQ_CST)) == 0)
+		futex_wait(&core->intpending, pending);
+	__atomic_store_n(&core->halted, 0, __ATOMIC_SEQ_CST);
+	__atomic_fetch_and(&core->intpending, ~CORE_RESTART_BIT, __ATOMIC_SEQ_CST);
+}
+
 void cpu_core_halt()
 {
 	/* unmask signals and call sigsuspend */
 	Core* core = curr_core();
 	assert(! core->int_disabled);
+	if(irq_polled) {
+		core_halt_polled(core);
+		dispatch_interrupts(core);
+		return;
+	}
+
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
 	pthread_mutex_lock(& core_halt_mutex);
 	core->halted = 1;
@@ -758,8 +933,20 @@ static inline void core_restart(Core* core)
 	}	
 }
 
+/* Restart in the polled mode; return 1 if the core was halted */
+static inline int core_restart_polled(Core* core)
+{
+	if(! __atomic_load_n(&core->halted, __ATOMIC_SEQ_CST)) return 0;
+	core_post(core, CORE_RESTART_BIT);
+	return 1;
+}
+
 void cpu_core_restart(uint c)
 {
+	if(irq_polled) {
+		core_restart_polled(CORE+c);
+		return;
+	}
 	pthread_mutex_lock(& core_halt_mutex);
 	core_restart(CORE+c);
 	pthread_mutex_unlock(& core_halt_mutex);	
@@ -767,6 +954,11 @@ void cpu_core_restart(uint c)
 
 void cpu_core_restart_one()
 {
+	if(irq_polled) {
+		for(uint c=0; c<ncores; c++)
+			if(core_restart_polled(CORE+c)) break;
+		return;
+	}
 	pthread_mutex_lock(& core_halt_mutex);
 	if(! is_rlist_empty(&halted_list)) {
 		core_restart((Core*) rlist_pop_front(&halted_list)->obj);
@@ -776,6 +968,11 @@ void cpu_core_restart_one()
 
 void cpu_core_restart_all()
 {
+	if(irq_polled) {
+		for(uint c=0; c<ncores; c++)
+			core_restart_polled(CORE+c);
+		return;
+	}
 	pthread_mutex_lock(& core_halt_mutex);
 	for(uint c=0; c<ncores; c++)
 		core_restart(CORE+c);
@@ -787,6 +984,21 @@ void cpu_core_barrier_sync()
 	pthread_barrier_wait(& core_barrier);
 }
 
+/* The number of cpu_relax() calls after which a spinning core yields its host CPU */
+#define CPU_RELAX_SPINS 128
+
+void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+	Core* core = curr_core();
+	if(++core->relax_count >= CPU_RELAX_SPINS) {
+		core->relax_count = 0;
+		sched_yield();
+	}
+}
+
 void cpu_ici(uint core)
 {
 	assert(core < ncores);
@@ -803,7 +1015,8 @@ void cpu_disable_interrupts()
 {
 	Core* core = curr_core();
 	if(! core->int_disabled) {
-		CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
+		if(! irq_polled)
+			CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
 		core->int_disabled = 1;
 	}
 }
@@ -813,12 +1026,86 @@ void cpu_enable_interrupts()
 	Core* core = curr_core();
 	if(core->int_disabled) {        
 		core->int_disabled = 0;
-		CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));      
-		dispatch_interrupts(curr_core());
+		if(! irq_polled)
+			CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));      
+		dispatch_interrupts(core);
 	}
 }
 
 
+#if defined(CPU_CONTEXT_ASM)
+
+/*
+	Save the callee-saved registers of the System V x86-64 ABI and the
+	MXCSR/x87 control words on the current stack, store the stack pointer
+	into *oldsp, load newsp and restore the same from it.
+
+	void cpu_context_switch(void** oldsp, void* newsp);
+ */
+void cpu_context_switch(void** oldsp, void* newsp);
+
+__asm__(
+	"	.text\n"
+	"	.p2align 4\n"
+	"	.type cpu_context_switch, @function\n"
+	"cpu_context_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	"	.size cpu_context_switch, .-cpu_context_switch\n"
+);
+
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+  /* 
+    Build the frame that cpu_context_switch() expects to find, so that
+    the first switch to this context 'returns' into ctx_func. The top of the 
+    stack is 16-byte aligned, and holds a null return address for ctx_func.
+  */
+  uintptr_t top = ((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15;
+  uint64_t* sp = (uint64_t*) top;
+
+  *--sp = 0;                     /* return address of ctx_func */
+  *--sp = (uint64_t) ctx_func;   /* return address of cpu_context_switch */
+  for(int i=0; i<6; i++)
+    *--sp = 0;                   /* rbp, rbx, r12-r15 */
+
+  /* Start with the floating-point control words of this context */
+  uint32_t mxcsr; uint16_t fpucw;
+  __asm__ volatile("stmxcsr %0" : "=m"(mxcsr));
+  __asm__ volatile("fnstcw %0" : "=m"(fpucw));
+  *--sp = (uint64_t)mxcsr | ((uint64_t)fpucw << 32);
+
+  ctx->sp = sp;
+}
+
+
+void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
+{
+	cpu_context_switch(&oldctx->sp, newctx->sp);
+}
+
+#else
+
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
   /* Init the context from this context! */
@@ -840,6 +1127,8 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 	swapcontext(oldctx, newctx);
 }
 
+#endif
+
 
 
 /*
@@ -859,8 +1148,8 @@ TimerDuration bios_set_timer(TimerDuration usec)
 
 	struct itimerspec oldtime;
 	
-	timer_settime(curr_core()->timer_id, 0, &newtime, &oldtime);
-	curr_core()->intpending[ALARM] = 0;
+	CHECK(timerfd_settime(curr_core()->timer_fd, 0, &newtime, &oldtime));
+	__atomic_fetch_and(&curr_core()->intpending, ~(1u << ALARM), __ATOMIC_SEQ_CST);
 
 	assert(oldtime.it_interval.tv_sec ==0 && oldtime.it_interval.tv_nsec==0);
 	return 1000000*oldtime.it_value.tv_sec + oldtime.it_value.tv_nsec/1000ull;
@@ -874,7 +1163,9 @@ TimerDuration bios_cancel_timer()
 
 TimerDuration bios_clock()
 {
-	return system_clock * 1000ul;
+	struct timespec curtime;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &curtime));
+	return curtime.tv_sec*1000000ul + curtime.tv_nsec/1000ul;
 }	
 
 
@@ -904,13 +1195,23 @@ void bios_serial_interrupt_core(uint serial, Interrupt intno, uint coreid)
 }
 
 
+/*
+	Return and clear the set of serial ports that raised 'intno' on this core.
+ */
+uint bios_serial_pending(Interrupt intno)
+{
+	assert(intno==SERIAL_RX_READY || intno==SERIAL_TX_READY);
+	return __atomic_exchange_n(&curr_core()->serial_pending[intno-SERIAL_RX_READY], 0, __ATOMIC_SEQ_CST);
+}
+
+
 /*
 	Try to read a byte from serial port 'serial' and store it into the location
 	pointed by 'ptr'.  If the operation succeds, 1 is returned. If not, 0 is returned.
  */
 int bios_read_serial(uint serial, char* ptr)
 {
-	return io_device_read(& TERM[serial].kbd, ptr);
+	return io_device_read(& TERM[serial].kbd, ptr, 1);
 }
 
 
@@ -920,7 +1221,31 @@ int bios_read_serial(uint serial, char* ptr)
  */
 int bios_write_serial(uint serial, char value)
 {
-	return io_device_write(& TERM[serial].con, value);
+	return io_device_write(& TERM[serial].con, &value, 1);
+}
+
+
+/*
+	Try to read up to 'size' bytes from serial port 'serial' into 'buf',
+	with a single system call. Return the number of bytes read.
+ */
+uint bios_read_serial_block(uint serial, char* buf, uint size)
+{
+	assert(serial < nterm);
+	if(size==0) return 0;
+	return io_device_read(& TERM[serial].kbd, buf, size);
+}
+
+
+/*
+	Try to write up to 'size' bytes from 'buf' to serial port 'serial',
+	with a single system call. Return the number of bytes written.
+ */
+uint bios_write_serial_block(uint serial, const char* buf, uint size)
+{
+	assert(serial < nterm);
+	if(size==0) return 0;
+	return io_device_write(& TERM[serial].con, buf, size);
 }
 
 
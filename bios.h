@@ -66,9 +66,9 @@
 
 	The virtual machine has a number of serial ports connected to terminals.
 
-	Each serial port/terminal can support reading and writing of single bytes.
-	The reads return keyboard input, whereas the writes send characters to display
-	on the screen.
+	Each serial port/terminal can support reading and writing of single bytes,
+	or of blocks of bytes. The reads return keyboard input, whereas the writes 
+	send characters to display on the screen.
 
 	Terminals are numbered from 0, up to @c MAX_TERMINALS-1. 
 
@@ -98,6 +98,9 @@
 	Also, each interrupt is sent if the serial device timeouts (is inactive for
 	about 300 msec).
 
+	An interrupt handler can find which serial ports raised the interrupt
+	by calling @c bios_serial_pending.
+
  */
 
 
@@ -128,8 +131,13 @@ typedef enum Interrupt
 } Interrupt;
 
 
-/** @brief Maximum number of cores for a virtual machine. */
-#define MAX_CORES 32
+/** 
+	@brief Maximum number of cores for a virtual machine. 
+
+	The core tables are allocated at boot time, for the requested number
+	of cores, so this is only a sanity limit.
+*/
+#define MAX_CORES 1024
 
 /** @brief Maximum number of terminals for a virtual machine. */
 #define MAX_TERMINALS 4
@@ -148,6 +156,14 @@ typedef enum Interrupt
 	The simulation ends (and this function returns) when (and if) all
 	cores return from bootfunc, in which case the VM shuts down.
 
+	Interrupts are delivered to the cores asynchronously, by signals. 
+	Alternatively, if the environment variable @c TINYOS_IRQ is set to
+	@c polled when this function is called, interrupts are only posted to
+	the cores, and are handled when a core enables interrupts (or returns
+	from @c cpu_core_halt). This mode avoids all signal-related system 
+	calls, but code that runs with interrupts enabled is not interrupted
+	until it disables and re-enables them.
+
 	@param bootfunc The function that each simulated core will execute at 
 			boot time. When all cores return from this function, the virtual
 			machine shuts down.
@@ -157,10 +173,39 @@ typedef enum Interrupt
 		pipes (aka FIFOs), which must already exist. See the serial API below 
 		for more details.
 
+	The simulated cores are not pinned to host cpus, unless the environment
+	variable @c TINYOS_AFFINITY is set, when this function is called. Its value
+	can be @c none (the default), @c compact (core @f$ c @f$ runs on the 
+	@f$ c @f$-th host cpu the process may run on, modulo the number of these 
+	cpus, so that @c taskset and cpusets are respected) or a list of host cpus, 
+	such as @c 0-7,16-23, which are assigned to the cores in order, wrapping
+	around if there are more cores than cpus.
+
+	@see vm_boot_ex
  */
 void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno);
 
 
+/**
+	@brief Boot a CPU, pinning the simulated cores to host cpus.
+
+	This is the same as @c vm_boot, except that the core to host cpu map
+	is given explicitly: core @f$ c @f$ is pinned to host cpu @c cpumap[c],
+	or left unpinned if @c cpumap[c] is negative. If @c cpumap is @c NULL,
+	the map is taken from @c TINYOS_AFFINITY, as for @c vm_boot.
+
+	Pinning the cores keeps each simulated core (and the per-core kernel
+	state it uses) on the same host cpu, which preserves cache locality.
+
+	@param bootfunc the boot function of each core, as for @c vm_boot
+	@param cores the number of simulated cores
+	@param serialno the number of serial ports
+	@param cpumap an array of @c cores host cpu numbers, or @c NULL
+	@see vm_boot
+ */
+void vm_boot_ex(interrupt_handler bootfunc, uint cores, uint serialno, const int* cpumap);
+
+
 /**
 	@brief Contains the id of the current core.
  */
@@ -264,11 +309,49 @@ void cpu_core_restart_one();
 void cpu_core_restart_all();
 
 
+/**
+	@brief Hint that the core is busy-waiting.
+
+	This should be called in every iteration of a spin loop. Like the PAUSE 
+	instruction, it tells the core that it is waiting for another core. 
+	In addition, a core that keeps spinning periodically gives up its host CPU, 
+	as a hypervisor deschedules a spinning virtual CPU. This matters when 
+	there are more cores than host CPUs, and the core being waited for 
+	is not running.
+*/
+void cpu_relax();
+
+
+#if defined(ASM_CONTEXT) && defined(__x86_64__)
+
+/**
+	@brief The CPU context switch is done by hand-written assembly.
+
+	This is enabled at build time by defining @c ASM_CONTEXT (the default
+	for x86-64 builds, see the Makefile). Only the callee-saved registers
+	and the floating-point control words are saved, on the stack of the
+	switched-out thread, and the signal mask is left untouched. Otherwise,
+	the ucontext functions of the C library are used.
+*/
+#define CPU_CONTEXT_ASM
+
+/**
+	@brief A type for saving CPU context into.
+
+	The registers are saved on the thread's own stack, so a context
+	is just the saved stack pointer.
+*/
+typedef struct cpu_context { void* sp; } cpu_context_t;
+
+#else
+
 /**
 	@brief A type for saving CPU context into.
 */
 typedef ucontext_t cpu_context_t;
 
+#endif
+
 
 /**
 	@brief Initialize a CPU context for a new thread.
@@ -302,9 +385,10 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx);
 	@brief Reset the core timer to the specified interval.
 
 	The interval for the timer is given in microseconds, but the 
-	accuracy of the alarm is much coarser, to the order of 10 msec
-	(that is, 10,000 microseconds). After the interval expires, the
-	core receives an ALARM interrupt.
+	accuracy of the alarm is coarser, since the ALARM interrupt is 
+	delivered through the host OS scheduler (typically, within tens of 
+	microseconds). After the interval expires, the core receives an 
+	ALARM interrupt.
 
 	This function can be called even if the timer is already activated;
 	in this case, the previous timer countdown is canceled and the timer resets
@@ -332,13 +416,12 @@ TimerDuration bios_cancel_timer();
 /**
 	@brief Get the current time from the hardware clock.
 
-	This function returns a real-time clock value, in usec.
-	The value of the clock is 10 times the number of seconds since
-	the epoch. 
+	This function returns a monotonic clock value, in usec, counted
+	from some unspecified point in the past. The clock is not affected
+	by changes to the host's wall-clock time.
 
-	The resolution of the clock is very low, currently 
-	around 100 msec. Therefore, it is inappropriate for any type of
-	precise timing.
+	The resolution of the clock is 1 usec, and reading it is cheap
+	(it does not enter the host kernel, on most systems).
  */
 TimerDuration bios_clock();
 
@@ -369,6 +452,25 @@ uint bios_serial_ports();
 void bios_serial_interrupt_core(uint serial, Interrupt intno, uint core);
 
 
+/**
+	@brief Return the serial ports that raised an interrupt on this core.
+
+	Each time a serial port raises @c SERIAL_RX_READY or @c SERIAL_TX_READY,
+	the port is marked as pending for this interrupt, on the core that receives 
+	the interrupt. This call returns the set of pending ports for @c intno
+	on the calling core, as a bit mask (bit @f$ i @f$ is set for port @f$ i @f$),
+	and clears it.
+
+	This is meant to be called by the interrupt handler, so that it only
+	services the ports that are ready. A port that becomes ready after this
+	call will raise the interrupt again.
+
+	@param intno the interrupt (one of @c SERIAL_RX_READY and @c SERIAL_TX_READY)
+	@return the bit mask of the ports that raised @c intno
+ */
+uint bios_serial_pending(Interrupt intno);
+
+
 /**
 	@brief Read a byte from a serial port.
 
@@ -403,4 +505,44 @@ int bios_read_serial(uint serial, char* ptr);
 int bios_write_serial(uint serial, char value);
 
 
+/**
+	@brief Read a block of bytes from a serial port.
+
+	Try to read up to @c size bytes from serial port @c serial into the buffer
+	@c buf. The bytes are transferred with a single operation on the host,
+	therefore this is much cheaper than reading the bytes one at a time.
+	The number of bytes read is returned; this may be less than @c size,
+	if fewer bytes are available.
+
+	If this operation returns 0, a @c SERIAL_RX_READY interrupt will be raised when
+	data is ready to be received, as for @c bios_read_serial.
+
+	@param serial the serial device to read from
+	@param buf the buffer in which to store the read bytes
+	@param size the maximum number of bytes to read
+	@return the number of bytes read, or 0 if the device is not ready
+	@see bios_read_serial
+ */
+uint bios_read_serial_block(uint serial, char* buf, uint size);
+
+
+/**
+	@brief Write a block of bytes to a serial port.
+
+	Try to write up to @c size bytes from buffer @c buf to serial port @c serial,
+	with a single operation on the host. The number of bytes written is returned;
+	this may be less than @c size, if the device cannot accept all of them.
+
+	If this operation returns 0, a @c SERIAL_TX_READY interrupt will be raised when
+	the device is ready to accept data, as for @c bios_write_serial.
+
+	@param serial the serial device to write to
+	@param buf the bytes to send to the serial device
+	@param size the maximum number of bytes to write
+	@return the number of bytes written, or 0 if the device is not ready
+	@see bios_write_serial
+ */
+uint bios_write_serial_block(uint serial, const char* buf, uint size);
+
+
 #endif
@@ -24,40 +24,323 @@
  	-------------------------
 
  	This mutex will act as a spinlock if preemption is off, and a
- 	yielding mutex if preemption is on.
+ 	sleeping mutex if preemption is on.
 
  	Therefore, we can call the same function from both the preemptive and
  	the non-preemptive domain of the kernel.
 
+ 	The mutex word is MUTEX_FREE, or else it holds the TCB of the owner,
+ 	tagged with MUTEX_LOCKED, and with MUTEX_CONTENDED when some thread may 
+ 	be sleeping on the mutex. In the preemptive domain, a thread that fails 
+ 	to get the lock spins only as long as the owner is running on some core,
+ 	since only then will the mutex be unlocked soon. Else, it marks the 
+ 	mutex as contended and parks itself in the parking lot (see below). 
+ 	An unlocker that finds the mutex contended wakes up one parked thread, 
+ 	which tries again. This is the mutex of the paper "Futexes are tricky"
+ 	by U. Drepper, with the parking lot in the role of the futex.
+
+ 	The threads parked on a mutex donate their priority to its owner (see
+ 	donate_priority). Whenever a thread parks, or gets a contended mutex, 
+ 	all the parked threads of the mutex are made to donate to its owner; when
+ 	the mutex is unlocked, their donations are withdrawn, and a thread that 
+ 	leaves the parking lot withdraws its own.
+
+ 	The owner is only used to guide waiting. A mutex may be unlocked by a 
+ 	thread other than its owner. 
+
  	The implementation is based on GCC atomics, as the standard C11 primitives
  	are not supported by all recent compilers. Eventually, this will change.
  */
+#define MUTEX_FREE MUTEX_INIT
+#define MUTEX_LOCKED 1
+#define MUTEX_CONTENDED 2
+#define MUTEX_OWNED(tcb) ((Mutex)(tcb) | MUTEX_LOCKED)
+#define MUTEX_OWNER(word) ((TCB*)((word) & ~(Mutex)(MUTEX_LOCKED|MUTEX_CONTENDED)))
+
+_Static_assert(_Alignof(TCB) > (MUTEX_LOCKED|MUTEX_CONTENDED), "the mutex tags do not fit in a TCB pointer");
+
+
+/*
+	The parking lot.
+	----------------
+
+	Threads sleeping on a mutex are kept in a hash table, keyed by the 
+	address of the mutex, so that a mutex needs no more room than its word.
+	Each bucket keeps a ring of waiters, in arrival order, for all the mutexes
+	that hash to it. The bucket lock is a spinlock, taken with preemption off,
+	since a mutex may be unlocked by an interrupt handler.
+ */
+
+/** \cond HELPER Helper structure for mutex waiters. */
+typedef struct __mutex_waiter {
+	rlnode node;				/* become part of a ring */
+	TCB* thread;				/* thread to wait */
+	Mutex* mutex;				/* the mutex waited on */
+	sig_atomic_t removed;		/* this is set if the waiter is removed 
+								   from the ring */
+} __mutex_waiter;
+
+#define PARKING_LOT_SIZE 64
+
+typedef struct parking_bucket {
+	Mutex lock;					/* spinlock protecting the waitset */
+	__mutex_waiter* waitset;	/* the ring of waiters, or NULL */
+} __attribute__((aligned(CCB_ALIGN))) parking_bucket;
+/** \endcond */
+
+static parking_bucket PARKING_LOT[PARKING_LOT_SIZE];
+
+static inline parking_bucket* parking_bucket_of(Mutex* mx)
+{
+	/* Fibonacci hashing of the address */
+	uint64_t h = (uintptr_t)mx * 0x9E3779B97F4A7C15ull;
+	return & PARKING_LOT[h >> 58];
+}
+_Static_assert(PARKING_LOT_SIZE == 64, "the hash of parking_bucket_of() yields 6 bits");
+
+static inline void parking_remove(parking_bucket* b, __mutex_waiter* w)
+{
+	if(b->waitset == w) {
+		__mutex_waiter* nextw = w->node.next->obj;
+		b->waitset = (nextw == w) ? NULL : nextw;
+	}
+	rlist_remove(& w->node);
+}
+
+/*
+	Make all the threads parked on mx in bucket b donate their priority 
+	to owner, or withdraw their donations if owner is NULL. This must be 
+	called with the bucket locked. 
+ */
+static void parking_donate(parking_bucket* b, Mutex* mx, TCB* owner)
+{
+	__mutex_waiter* w = b->waitset;
+	if(w == NULL) return;
+	do {
+		if(w->mutex == mx)
+			donate_priority(w->thread, owner);
+		w = w->node.next->obj;
+	} while(w != b->waitset);
+}
+
+/*
+	Add a waiter to the ring of bucket b, for a mutex whose value is val. 
+	This must be called with the bucket locked, and val must be contended.
+ */
+static void parking_add(parking_bucket* b, __mutex_waiter* w, Mutex val)
+{
+	if(b->waitset) 
+		rlist_push_back(& b->waitset->node, & w->node);
+	else
+		b->waitset = w;
+
+	/* The waiters donate their priority to the owner. The owner cannot exit 
+	   before we release the bucket lock, as its unlock must pass from 
+	   mutex_unpark(), which withdraws the donations. */
+	parking_donate(b, w->mutex, MUTEX_OWNER(val));
+}
+
+/*
+	Sleep on mx, as long as the value of mx is val, which is checked 
+	under the bucket lock. Return when woken up by mutex_unpark(), or 
+	at once if the value has changed.
+ */
+static void mutex_park(Mutex* mx, Mutex val)
+{
+	parking_bucket* b = parking_bucket_of(mx);
+	__mutex_waiter waiter = { .mutex = mx, .removed = 0 };
+	rlnode_init(& waiter.node, &waiter);
+
+	int preempt = preempt_off;
+	waiter.thread = CURTHREAD;
+	Mutex_Lock(& b->lock);
+
+	if(__atomic_load_n(mx, __ATOMIC_ACQUIRE) == val) {
+		parking_add(b, &waiter, val);
+		sleep_releasing(STOPPED, & b->lock, SCHED_MUTEX, NO_TIMEOUT);
+
+		Mutex_Lock(& b->lock);
+		if(! waiter.removed) {
+			parking_remove(b, &waiter);
+			donate_priority(waiter.thread, NULL);
+		}
+	}
+
+	Mutex_Unlock(& b->lock);
+	if(preempt) preempt_on;
+}
+
+/*
+	Wake up the first thread parked on mx, if any.
+ */
+static void mutex_unpark(Mutex* mx)
+{
+	parking_bucket* b = parking_bucket_of(mx);
+
+	int preempt = preempt_off;
+	Mutex_Lock(& b->lock);
+
+	/* The mutex has no owner now */
+	parking_donate(b, mx, NULL);
+
+	if(b->waitset) {
+		__mutex_waiter* w = b->waitset;
+		do {
+			if(w->mutex == mx) {
+				parking_remove(b, w);
+				w->removed = 1;
+				wakeup(w->thread);
+				break;
+			}
+			w = w->node.next->obj;
+		} while(w != b->waitset);
+	}
+
+	Mutex_Unlock(& b->lock);
+	if(preempt) preempt_on;
+}
+
+
+/*
+	Add the waiter of a thread that sleeps elsewhere to the parking lot of mx, 
+	as if the thread had parked on mx. This is used for wait morphing. 
+	Return 0 if mx is not locked, in which case the waiter is not added, 
+	and the thread must be woken up instead.
+ */
+static int mutex_requeue(Mutex* mx, __mutex_waiter* w)
+{
+	parking_bucket* b = parking_bucket_of(mx);
+
+	int preempt = preempt_off;
+	Mutex_Lock(& b->lock);
+
+	/* Mark mx as contended, so that its unlocker will wake up the waiter */
+	Mutex c = __atomic_load_n(mx, __ATOMIC_RELAXED);
+	while(c != MUTEX_FREE && ! (c & MUTEX_CONTENDED) &&
+		! __atomic_compare_exchange_n(mx, &c, c|MUTEX_CONTENDED, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	int requeued = (c != MUTEX_FREE);
+	if(requeued)
+		parking_add(b, w, c|MUTEX_CONTENDED);
+
+	Mutex_Unlock(& b->lock);
+	if(preempt) preempt_on;
+	return requeued;
+}
+
+/*
+	Take back a waiter added by mutex_requeue(), if it is still in the 
+	parking lot, as its thread woke up for another reason.
+ */
+static void mutex_unqueue(__mutex_waiter* w)
+{
+	parking_bucket* b = parking_bucket_of(w->mutex);
+
+	int preempt = preempt_off;
+	Mutex_Lock(& b->lock);
+	if(! w->removed) {
+		parking_remove(b, w);
+		donate_priority(w->thread, NULL);
+	}
+	Mutex_Unlock(& b->lock);
+	if(preempt) preempt_on;
+}
+
+
+/*
+	Return the core where tcb is the current thread, or -1. The TCB
+	is not accessed, as the thread may have exited.
+ */
+static int mutex_owner_core(TCB* tcb)
+{
+	uint ncores = cpu_cores();
+	for(uint c=0; c<ncores; c++)
+		if(__atomic_load_n(& cctx[c].current_thread, __ATOMIC_RELAXED) == tcb)
+			return c;
+	return -1;
+}
+
+
+/*
+	Make the threads still parked on a mutex we just got donate to us.
+ */
+static void mutex_adopt_donors(Mutex* mx, TCB* self)
+{
+	parking_bucket* b = parking_bucket_of(mx);
+
+	int preempt = preempt_off;
+	Mutex_Lock(& b->lock);
+	/* The mutex may have been unlocked meanwhile, by another thread */
+	if(MUTEX_OWNER(__atomic_load_n(mx, __ATOMIC_RELAXED)) == self)
+		parking_donate(b, mx, self);
+	Mutex_Unlock(& b->lock);
+	if(preempt) preempt_on;
+}
+
+
+/*
+	Sleep until we get the lock. Since we do not know if others are parked,
+	we must leave the mutex marked as contended.
+ */
+static void mutex_lock_contended(Mutex* lock, TCB* self)
+{
+	Mutex c = __atomic_load_n(lock, __ATOMIC_RELAXED);
+	for(;;) {
+		if(c == MUTEX_FREE) {
+			if(__atomic_compare_exchange_n(lock, &c, MUTEX_OWNED(self)|MUTEX_CONTENDED, 0, 
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+				mutex_adopt_donors(lock, self);
+				return;
+			}
+			continue;
+		}
+		if(! (c & MUTEX_CONTENDED) && 
+			! __atomic_compare_exchange_n(lock, &c, c|MUTEX_CONTENDED, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			continue;
+		mutex_park(lock, c|MUTEX_CONTENDED);
+		c = __atomic_load_n(lock, __ATOMIC_RELAXED);
+	}
+}
+
+
 void Mutex_Lock(Mutex* lock)
 {
-#define MUTEX_SPINS 1000
-
-  while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
-    int spin=MUTEX_SPINS;
-    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
-#if defined(__x86__) || (__x86_64__)
-      __builtin_ia32_pause();
-#endif
-      if(spin>0) 
-      	spin--; 
-      else { 
-      	spin=MUTEX_SPINS; 
-      	if(get_core_preemption())
-      		yield(SCHED_MUTEX); 
-      }
-    }
-  }
-#undef MUTEX_SPINS
+	TCB* self = CURTHREAD;
+	Mutex c = MUTEX_FREE;
+	if(__atomic_compare_exchange_n(lock, &c, MUTEX_OWNED(self), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	/* In the non-preemptive domain we spin, else only while the owner runs */
+	int preemptive = get_core_preemption();
+	TCB* owner = NULL;
+	int owner_core = -1;
+	for(;;) {
+		c = __atomic_load_n(lock, __ATOMIC_RELAXED);
+		if(c == MUTEX_FREE) {
+			if(__atomic_compare_exchange_n(lock, &c, MUTEX_OWNED(self), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return;
+			continue;
+		}
+		if(preemptive) {
+			if(MUTEX_OWNER(c) != owner) {
+				owner = MUTEX_OWNER(c);
+				owner_core = mutex_owner_core(owner);
+			}
+			if(owner_core < 0 || 
+				__atomic_load_n(& cctx[owner_core].current_thread, __ATOMIC_RELAXED) != owner)
+				break;
+		}
+		cpu_relax();
+	}
+
+	mutex_lock_contended(lock, self);
 }
 
 
 void Mutex_Unlock(Mutex* lock)
 {
-  __atomic_clear(lock, __ATOMIC_RELEASE);
+	if(__atomic_exchange_n(lock, MUTEX_FREE, __ATOMIC_RELEASE) & MUTEX_CONTENDED)
+		mutex_unpark(lock);
 }
 
 
@@ -73,6 +356,9 @@ typedef struct __cv_waiter {
 	sig_atomic_t signalled;		/* this is set if the thread is signalled */
 	sig_atomic_t removed;		/* this is set if the waiter is removed 
 								   from the ring */
+	sig_atomic_t morphed;		/* this is set if the waiter was moved to
+								   the mutex, by Cond_Broadcast */
+	__mutex_waiter park;		/* the waiter for the mutex, if morphed */
 } __cv_waiter;
 /** \endcond */
 
@@ -121,8 +407,10 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
 static int cv_wait(Mutex* mutex, CondVar* cv, 
 		enum SCHED_CAUSE cause, TimerDuration timeout)
 {
-	__cv_waiter waiter = { .thread=CURTHREAD, .signalled = 0, .removed=0 };
+	__cv_waiter waiter = { .thread=CURTHREAD, .signalled = 0, .removed=0, .morphed=0,
+		.park = { .thread=CURTHREAD, .mutex=mutex, .removed=0 } };
 	rlnode_init(& waiter.node, &waiter);
+	rlnode_init(& waiter.park.node, &waiter.park);
 
 	Mutex_Lock(&(cv->waitset_lock));
 	/* We just push the current thread to the back of the list */
@@ -147,7 +435,13 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 	}
 	Mutex_Unlock(&(cv->waitset_lock));
 
-	Mutex_Lock(mutex);
+	if(waiter.morphed) {
+		/* We were woken up by the unlocker of the mutex (or by a timeout), 
+		   and other morphed waiters may still be parked on the mutex. */
+		mutex_unqueue(& waiter.park);
+		mutex_lock_contended(mutex, waiter.thread);
+	} else
+		Mutex_Lock(mutex);
 	return waiter.signalled;
 }
 
@@ -185,6 +479,11 @@ int Cond_TimedWait(Mutex* mutex, CondVar* cv, timeout_t timeout)
 	return cv_wait(mutex, cv, SCHED_USER, timeout*1000ul);
 }
 
+int Cond_TimedWaitUsec(Mutex* mutex, CondVar* cv, unsigned long usec)
+{
+	return cv_wait(mutex, cv, SCHED_USER, usec);
+}
+
 
 void Cond_Signal(CondVar* cv)
 {
@@ -194,10 +493,26 @@ void Cond_Signal(CondVar* cv)
 }
 
 
+/*
+  Wait morphing: instead of waking up all the waiters, only for them to 
+  contend for the mutex, the waiters are moved to the parking lot of the 
+  mutex, if it is locked. Then, they are woken up one at a time, as the 
+  mutex is unlocked. If the mutex is not locked, the waiters are woken up.
+ */
 void Cond_Broadcast(CondVar* cv)
 {
   Mutex_Lock(&(cv->waitset_lock));
-  while(cv->waitset) cv_signal(cv);
+  while(cv->waitset) {
+    __cv_waiter* waiter = cv->waitset;
+    remove_from_ring(cv, waiter);
+    waiter->removed = 1;
+    if(mutex_requeue(waiter->park.mutex, &waiter->park)) {
+      waiter->morphed = 1;
+      waiter->signalled = 1;
+    }
+    else if(wakeup(waiter->thread))
+      waiter->signalled = 1;
+  }
   Mutex_Unlock(&(cv->waitset_lock));
 }
 
@@ -294,6 +609,12 @@ int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause,
 	return ret;
 }
 
+int kernel_wait_mutex_wchan(CondVar* cv, Mutex* mx, enum SCHED_CAUSE cause, 
+	const char* wchan_name, TimerDuration timeout)
+{
+	return cv_wait(mx, cv, cause, timeout);
+}
+
 void kernel_signal(CondVar* cv) 
 { 
 	Cond_Signal(cv); 
@@ -59,6 +59,25 @@ int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause,
 #define kernel_timedwait(cv, cause, timeout) \
 	kernel_wait_wchan((cv),(cause),__FUNCTION__, (timeout))
 
+/**
+	@brief Wait on a condition variable, releasing a kernel mutex.
+
+	This is used by kernel code that protects its state by a (preemption-aware)
+	mutex of its own, such as the process table lock, the lock of a pipe, or
+	a device lock shared with an interrupt handler, instead of the kernel lock.
+	The caller must hold @c mx (and not the kernel lock). The thread sleeps 
+	releasing @c mx atomically, and @c mx is held again on return.
+
+	@returns 1 if signalled, 0 if not
+  */
+int kernel_wait_mutex_wchan(CondVar* cv, Mutex* mx, enum SCHED_CAUSE cause, 
+	const char* wchan, TimerDuration timeout);
+
+#define kernel_wait_mutex(cv, mx, cause) \
+	kernel_wait_mutex_wchan((cv),(mx),(cause),__FUNCTION__, NO_TIMEOUT)
+#define kernel_timedwait_mutex(cv, mx, cause, timeout) \
+	kernel_wait_mutex_wchan((cv),(mx),(cause),__FUNCTION__, (timeout))
+
 /**
 	@brief Signal a kernel condition to one waiter.
 
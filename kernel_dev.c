@@ -66,10 +66,28 @@ static file_ops nulldev_fops = {
 void serial_rx_handler();
 void serial_tx_handler();
 
+/** @brief The size of the receive buffer of each serial device */
+#define SERIAL_RX_BUFFER_SIZE 4096
+
+/** @brief The size of the transmit buffer of each serial device */
+#define SERIAL_TX_BUFFER_SIZE 4096
+
+/** @brief How long (in usec) a Close waits for the output to make progress */
+#define SERIAL_CLOSE_TIMEOUT 500000
+
 typedef struct serial_device_control_block {
   uint devno;
-  Mutex spinlock;
-  CondVar rx_ready;
+  Mutex spinlock;       /* protects the buffers, shared with the interrupt handlers */
+
+  char rx_buffer[SERIAL_RX_BUFFER_SIZE];  /* ring buffer of received input */
+  uint rx_head;         /* index of the first received byte */
+  uint rx_count;        /* number of received bytes */
+  CondVar rx_ready;     /* signalled when bytes enter the rx buffer */
+
+  char tx_buffer[SERIAL_TX_BUFFER_SIZE];  /* ring buffer of pending output */
+  uint tx_head;         /* index of the first pending byte */
+  uint tx_count;        /* number of pending bytes */
+  CondVar tx_space;     /* signalled when bytes leave the tx buffer */
 } serial_dcb_t;
 
 serial_dcb_t serial_dcb[MAX_TERMINALS];
@@ -78,19 +96,61 @@ serial_dcb_t serial_dcb[MAX_TERMINALS];
 
 /*
   Interrupt-driven driver for serial-device reads.
+
+  The SERIAL_RX_READY handler moves the available input of each ready
+  port into the rx buffer of the port, and wakes up the readers of that 
+  port only. Readers copy from the rx buffer.
+
+  The device only raises an interrupt when it turns from not-ready to
+  ready. Therefore, when the rx buffer fills up before the device runs
+  out of input, the buffer must be refilled by the readers, once they 
+  make room.
+
+  The rx buffer is protected by the device spinlock, which must be held
+  with preemption off.
  */
 
+/* 
+  Move input from the device to the rx buffer, until the buffer is full
+  or the device is not ready. Return the number of bytes moved.
+ */
+static uint serial_rx_fill(serial_dcb_t* dcb)
+{
+  uint filled = 0;
+
+  while(dcb->rx_count < SERIAL_RX_BUFFER_SIZE) {
+    /* An empty buffer restarts from the beginning, to receive in one piece */
+    if(dcb->rx_count == 0) dcb->rx_head = 0;
+
+    /* Receive into the contiguous free part of the buffer */
+    uint tail = (dcb->rx_head + dcb->rx_count) % SERIAL_RX_BUFFER_SIZE;
+    uint len = (tail >= dcb->rx_head) ? SERIAL_RX_BUFFER_SIZE - tail 
+                                      : dcb->rx_head - tail;
+
+    uint n = bios_read_serial_block(dcb->devno, &dcb->rx_buffer[tail], len);
+    if(n==0) break;
+
+    dcb->rx_count += n;
+    filled += n;
+  }
+
+  return filled;
+}
+
+
 void serial_rx_handler()
 {
   int pre = preempt_off;
 
-  /* 
-    We do not know which terminal is
-    ready, so we must signal them all !
-   */
+  uint ports = bios_serial_pending(SERIAL_RX_READY);
   for(int i=0;i<bios_serial_ports();i++) {
+    if(! (ports & (1u << i))) continue;
+
     serial_dcb_t* dcb = &serial_dcb[i];
-    Cond_Broadcast(&dcb->rx_ready);
+    Mutex_Lock(&dcb->spinlock);
+    if(serial_rx_fill(dcb))
+      Cond_Broadcast(&dcb->rx_ready);
+    Mutex_Unlock(&dcb->spinlock);
   }
   if(pre) preempt_on;
 }
@@ -103,22 +163,31 @@ int serial_read(void* dev, char *buf, unsigned int size)
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
   preempt_off;            /* Stop preemption */
+  Mutex_Lock(&dcb->spinlock);
 
-  uint count =  0;
+  /* Wait for input, if the buffer is empty and the device has none */
+  while(size > 0 && dcb->rx_count == 0 && serial_rx_fill(dcb) == 0)
+    kernel_wait_mutex(&dcb->rx_ready, &dcb->spinlock, SCHED_IO);
 
-  while(count<size) {
-    int valid = bios_read_serial(dcb->devno, &buf[count]);
-    
-    if (valid) {
-      count++;
-    }
-    else if(count==0) {
-      kernel_wait(&dcb->rx_ready, SCHED_IO);
-    }
-    else
-      break;
+  /* Copy from the buffer, in at most two pieces */
+  int was_full = (dcb->rx_count == SERIAL_RX_BUFFER_SIZE);
+  uint count =  0;
+  while(count < size && dcb->rx_count > 0) {
+    uint len = SERIAL_RX_BUFFER_SIZE - dcb->rx_head;
+    if(len > dcb->rx_count) len = dcb->rx_count;
+    if(len > size - count) len = size - count;
+
+    memcpy(&buf[count], &dcb->rx_buffer[dcb->rx_head], len);
+    dcb->rx_head = (dcb->rx_head + len) % SERIAL_RX_BUFFER_SIZE;
+    dcb->rx_count -= len;
+    count += len;
   }
 
+  /* The device may hold more input, without raising an interrupt (see above) */
+  if(was_full)
+    serial_rx_fill(dcb);
+
+  Mutex_Unlock(&dcb->spinlock);
   preempt_on;           /* Restart preemption */
 
   return count;
@@ -126,44 +195,119 @@ int serial_read(void* dev, char *buf, unsigned int size)
 
 
 /*
-  A polling driver for serial writes
-  */
+  An interrupt-driven driver for serial writes.
+
+  Writers copy their data into the tx buffer of the device, and the
+  buffer is drained into the device as long as it accepts data. When the
+  device is not ready, the draining resumes from the SERIAL_TX_READY 
+  interrupt handler. Writers only block when the buffer is full.
+
+  The tx buffer is protected by the device spinlock, which must be held
+  with preemption off.
+ */
+
+/* 
+  Move pending bytes from the tx buffer to the device, until the buffer 
+  is empty or the device is not ready.
+ */
+static void serial_tx_drain(serial_dcb_t* dcb)
+{
+  uint drained = 0;
+
+  while(dcb->tx_count > 0) {
+    /* Send the contiguous part of the pending bytes */
+    uint len = SERIAL_TX_BUFFER_SIZE - dcb->tx_head;
+    if(len > dcb->tx_count) len = dcb->tx_count;
+
+    uint n = bios_write_serial_block(dcb->devno, &dcb->tx_buffer[dcb->tx_head], len);
+    if(n==0) break;
+
+    dcb->tx_head = (dcb->tx_head + n) % SERIAL_TX_BUFFER_SIZE;
+    dcb->tx_count -= n;
+    drained += n;
+  }
+
+  if(drained)
+    Cond_Broadcast(&dcb->tx_space);
+}
+
 
 /* Interrupt driver */
 void serial_tx_handler()
 {
-  /* There is nothing to do */
+  int pre = preempt_off;
+
+  uint ports = bios_serial_pending(SERIAL_TX_READY);
+  for(int i=0;i<bios_serial_ports();i++) {
+    if(! (ports & (1u << i))) continue;
+
+    serial_dcb_t* dcb = &serial_dcb[i];
+    Mutex_Lock(&dcb->spinlock);
+    serial_tx_drain(dcb);
+    Mutex_Unlock(&dcb->spinlock);
+  }
+  if(pre) preempt_on;
 }
 
 /* 
-  Write call 
-  This is currently a polling driver.
+  Write call.
+  Copy as much as fits into the tx buffer, blocking only if the 
+  buffer is full.
 */
 int serial_write(void* dev, const char* buf, unsigned int size)
 {
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
+  preempt_off;            /* Stop preemption */
+  Mutex_Lock(&dcb->spinlock);
+
+  /* Wait until there is room in the buffer */
+  while(size > 0 && dcb->tx_count == SERIAL_TX_BUFFER_SIZE)
+    kernel_wait_mutex(&dcb->tx_space, &dcb->spinlock, SCHED_IO);
+
+  /* Copy into the buffer, in at most two pieces */
   unsigned int count = 0;
-  while(count < size) {
-    int success = bios_write_serial(dcb->devno, buf[count] );
-
-    if(success) {
-      count++;
-    } 
-    else if(count==0)
-    {
-      yield(SCHED_IO);
-    }
-    else
-      break;
+  while(count < size && dcb->tx_count < SERIAL_TX_BUFFER_SIZE) {
+    uint tail = (dcb->tx_head + dcb->tx_count) % SERIAL_TX_BUFFER_SIZE;
+    uint len = (tail >= dcb->tx_head) ? SERIAL_TX_BUFFER_SIZE - tail 
+                                      : dcb->tx_head - tail;
+    if(len > size - count) len = size - count;
+
+    memcpy(&dcb->tx_buffer[tail], &buf[count], len);
+    dcb->tx_count += len;
+    count += len;
   }
 
+  /* Start the transmission */
+  serial_tx_drain(dcb);
+
+  Mutex_Unlock(&dcb->spinlock);
+  preempt_on;           /* Restart preemption */
+
   return count;  
 }
 
 
+/*
+  Closing waits for the pending output to be transmitted, as long as the 
+  terminal keeps accepting it. If no byte is taken for SERIAL_CLOSE_TIMEOUT 
+  (the terminal is not read), Close returns anyway, and the output stays 
+  in the buffer of the device, to be sent when the terminal is read again.
+ */
 int serial_close(void* dev) 
 {
+  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+
+  int pre = preempt_off;
+  Mutex_Lock(&dcb->spinlock);
+  while(dcb->tx_count > 0) {
+    uint pending = dcb->tx_count;
+    kernel_timedwait_mutex(&dcb->tx_space, &dcb->spinlock, SCHED_IO, SERIAL_CLOSE_TIMEOUT);
+    if(dcb->tx_count >= pending) break;
+  }
+  Mutex_Unlock(&dcb->spinlock);
+  if(pre) preempt_on;
+
   return 0;
 }
 
@@ -209,8 +353,13 @@ void initialize_devices()
   /* Initialize the serial devices */
   for(int i=0; i<bios_serial_ports(); i++) {
     serial_dcb[i].devno = i;
+    serial_dcb[i].rx_head = 0;
+    serial_dcb[i].rx_count = 0;
     serial_dcb[i].rx_ready = COND_INIT;
     serial_dcb[i].spinlock = MUTEX_INIT;
+    serial_dcb[i].tx_head = 0;
+    serial_dcb[i].tx_count = 0;
+    serial_dcb[i].tx_space = COND_INIT;
   }
 
   cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
@@ -34,11 +34,12 @@ void boot_tinyos_kernel()
 {
 
   if(cpu_core_id==0) {
-    /* Initialize the kenrel data structures */
+    /* Initialize the kenrel data structures. The scheduler goes first, 
+       because it allocates the core control blocks */
+    initialize_scheduler();
     initialize_processes();
     initialize_devices();
     initialize_files();
-    initialize_scheduler();
 
     /* The boot task is executed normally! */
     if(Exec(boot_rec.init_task, boot_rec.argl, boot_rec.args)!=1)
@@ -53,19 +54,31 @@ void boot_tinyos_kernel()
 
   run_scheduler();
 
+  /* Wait for all cores to leave the scheduler before cleaning up */
+  cpu_core_barrier_sync();
+
   if(cpu_core_id==0) {
-    /* Here, we could add cleanup after the scheduler has ended. */    
+    /* The device interrupt handlers must not run on freed core control blocks */
+    cpu_disable_interrupts();
+    finalize_scheduler();
   }
 }
 
 
-void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
+void boot_ex(uint ncores, uint nterm, const int* cpumap, 
+  Task boot_task, int argl, void* args)
 {
   boot_rec.init_task = boot_task;
   boot_rec.argl = argl;
   boot_rec.args = args;
 
-  vm_boot(boot_tinyos_kernel, ncores, nterm);
+  vm_boot_ex(boot_tinyos_kernel, ncores, nterm, cpumap);
+}
+
+
+void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
+{
+  boot_ex(ncores, nterm, NULL, boot_task, argl, args);
 }
 
 
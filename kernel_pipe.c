@@ -9,6 +9,12 @@ int pipe_read(void* this, char* buffer, unsigned int size);
 int pipe_write(void* this, const char* buffer, unsigned int size);
 int pipe_close_reader(void* this);
 int pipe_close_writer(void* this);
+static int pipe_read_fast(pipe_cb* curPipe, char* buffer, unsigned int size);
+static int pipe_write_fast(pipe_cb* curPipe, const char* buffer, unsigned int size);
+static int pipe_read_locked(pipe_cb* curPipe, char* buffer, unsigned int size);
+static int pipe_write_locked(pipe_cb* curPipe, const char* buffer, unsigned int size);
+static void pipe_lock(pipe_cb* curPipe);
+static void pipe_unlock(pipe_cb* curPipe);
 
 static file_ops readOperations = {
 	.Open = NULL,
@@ -29,16 +35,34 @@ pipe_cb* pipe_init(){
 
 	pipe_cb* pipe = (pipe_cb*)xmalloc(sizeof(pipe_cb));
 	
+	pipe->lock = MUTEX_INIT;
 	pipe->r_position = pipe->w_position = 0;
 	pipe->has_data = COND_INIT;
 	pipe->has_space = COND_INIT;
 
-	pipe->capacity = PIPE_BUFFER_SIZE-1;
+	/* The buffer is allocated by the first write */
+	pipe->BUFFER = NULL;
+	pipe->size = 0;
+	pipe->limit = PIPE_BUFFER_SIZE;
+	pipe->peak = 0;
+
+	pipe->readers_waiting = pipe->writers_waiting = 0;
+	pipe->fast_reader = pipe->fast_writer = 0;
+	pipe->slow = 0;
+	pipe->read_pinned = pipe->write_pinned = 0;
 
 	return pipe;	
 }
 
 
+/* Release a pipe, once both its ends are closed */
+static void pipe_free(pipe_cb* pipe)
+{
+	free(pipe->BUFFER);
+	free(pipe);
+}
+
+
 int sys_Pipe(pipe_t* pipe)
 {
 
@@ -54,6 +78,7 @@ int sys_Pipe(pipe_t* pipe)
 
 	pipe_cb* newPipe = pipe_init();
 	if(newPipe==NULL){
+		FCB_unreserve(2,fids,fcbs);
 		return -1;
 	}
 
@@ -69,6 +94,7 @@ int sys_Pipe(pipe_t* pipe)
 	fcbs[0]->streamfunc = &readOperations;
 	fcbs[1]->streamfunc = &writeOperations;
 
+	FCB_publish(2,fids,fcbs);
 	return 0;
 }
 
@@ -79,42 +105,398 @@ int pipe_read(void* this, char* buffer, unsigned int size){
 
 	pipe_cb* curPipe = (pipe_cb*)this;
 
-	if(curPipe==NULL || size<=0 || curPipe->reader == NULL){
+	if(curPipe==NULL || size<=0){
 		return -1;
 	}
 
-	//EOF
-	if(curPipe->writer==NULL && curPipe->r_position == curPipe->w_position){
+	int i = pipe_read_fast(curPipe, buffer, size);
+	if(i > 0)
+		return i;
+
+	pipe_lock(curPipe);
+	i = pipe_read_locked(curPipe, buffer, size);
+	pipe_unlock(curPipe);
+	return i;
+}
+
+
+/* The number of bytes in the pipe */
+static inline unsigned int pipe_count(pipe_cb* curPipe)
+{
+	return __atomic_load_n(&curPipe->w_position, __ATOMIC_ACQUIRE) 
+		- __atomic_load_n(&curPipe->r_position, __ATOMIC_ACQUIRE);
+}
+
+/* 
+	Copy n bytes out of the ring buffer, starting offset bytes past the read 
+	position, without removing them. The data may wrap around the end of the
+	buffer, so this takes up to two memcpy calls.
+ */
+static void pipe_peek(pipe_cb* curPipe, unsigned int offset, char* buffer, unsigned int n)
+{
+	unsigned int pos = (curPipe->r_position + offset) & (curPipe->size - 1);
+	unsigned int chunk = curPipe->size - pos;
+	if(chunk > n) chunk = n;
+
+	if(n == 0) return;
+	memcpy(buffer, curPipe->BUFFER + pos, chunk);
+	if(n > chunk)
+		memcpy(buffer + chunk, curPipe->BUFFER, n - chunk);
+}
+
+/* Remove n bytes from the pipe, publishing the space to the writer */
+static inline void pipe_consume(pipe_cb* curPipe, unsigned int n)
+{
+	__atomic_store_n(&curPipe->r_position, curPipe->r_position + n, __ATOMIC_RELEASE);
+}
+
+/* Add n bytes, stored at the write position, publishing them to the reader */
+static inline void pipe_produce(pipe_cb* curPipe, unsigned int n)
+{
+	__atomic_store_n(&curPipe->w_position, curPipe->w_position + n, __ATOMIC_RELEASE);
+	if(pipe_count(curPipe) > curPipe->peak)
+		curPipe->peak = pipe_count(curPipe);
+}
+
+/* Copy n bytes out of the ring buffer, which must hold at least n bytes. */
+static void pipe_copy_out(pipe_cb* curPipe, char* buffer, unsigned int n)
+{
+	pipe_peek(curPipe, 0, buffer, n);
+	pipe_consume(curPipe, n);
+}
+
+/* Copy n bytes into the ring buffer, which must have room for n bytes. */
+static void pipe_copy_in(pipe_cb* curPipe, const char* buffer, unsigned int n)
+{
+	unsigned int pos = curPipe->w_position & (curPipe->size - 1);
+	unsigned int chunk = curPipe->size - pos;
+	if(chunk > n) chunk = n;
+
+	memcpy(curPipe->BUFFER + pos, buffer, chunk);
+	memcpy(curPipe->BUFFER, buffer + chunk, n - chunk);
+
+	pipe_produce(curPipe, n);
+}
+
+/* The data at the read position, up to the end of the buffer */
+static char* pipe_data_chunk(pipe_cb* curPipe, unsigned int* len)
+{
+	unsigned int pos = curPipe->r_position & (curPipe->size - 1);
+	unsigned int count = pipe_count(curPipe);
+	*len = (curPipe->size - pos < count) ? curPipe->size - pos : count;
+	return curPipe->BUFFER + pos;
+}
+
+/* The free space of the buffer at the write position, up to its end */
+static char* pipe_space_chunk(pipe_cb* curPipe, unsigned int* len)
+{
+	unsigned int pos = curPipe->w_position & (curPipe->size - 1);
+	unsigned int space = curPipe->size - pipe_count(curPipe);
+	*len = (curPipe->size - pos < space) ? curPipe->size - pos : space;
+	return curPipe->BUFFER + pos;
+}
+
+/* 
+	Replace the buffer with one of the given size (0 releases it), which 
+	must hold the bytes in the pipe. 
+ */
+static void pipe_resize(pipe_cb* curPipe, unsigned int size)
+{
+	unsigned int count = pipe_count(curPipe);
+	assert(count <= size);
+	assert(! curPipe->read_pinned && ! curPipe->write_pinned);
+
+	char* buffer = (size > 0) ? xmalloc(size) : NULL;
+	/* An empty pipe may have no buffer to copy from, or to */
+	if(count > 0 && buffer != NULL && curPipe->BUFFER != NULL)
+		pipe_copy_out(curPipe, buffer, count);
+
+	free(curPipe->BUFFER);
+	curPipe->BUFFER = buffer;
+	curPipe->size = size;
+	curPipe->r_position = 0;
+	curPipe->w_position = count;
+	curPipe->peak = count;
+}
+
+/* The free space at which a blocked writer is woken up */
+static inline unsigned int pipe_low_water(pipe_cb* curPipe)
+{
+	return curPipe->limit / 4;
+}
+
+/* The smallest buffer size, a power of 2, that can hold n bytes */
+static unsigned int pipe_fit(unsigned int n)
+{
+	unsigned int size = PIPE_BUFFER_MIN;
+	while(size < n) size <<= 1;
+	return size;
+}
+
+/* The most bytes the pipe can hold now: the buffer cannot grow while pinned */
+static inline unsigned int pipe_room(pipe_cb* curPipe)
+{
+	if(curPipe->read_pinned && curPipe->size < curPipe->limit)
+		return curPipe->size;
+	return curPipe->limit;
+}
+
+/* Grow the buffer to hold n more bytes, which must fit in the room */
+static void pipe_grow(pipe_cb* curPipe, unsigned int n)
+{
+	if(pipe_count(curPipe) + n > curPipe->size){
+		unsigned int newsize = pipe_fit(pipe_count(curPipe) + n);
+		if(newsize < 2*curPipe->size) newsize = 2*curPipe->size;
+		if(newsize > curPipe->limit) newsize = curPipe->limit;
+		pipe_resize(curPipe, newsize);
+	}
+}
+
+
+/*
+	Lock-free transfers.
+
+	When an end of the pipe is used by a single thread (its FCB is referenced
+	only by one fid, and by the caller), the transfer moves data through the 
+	ring without taking the pipe lock: the reader owns r_position and the 
+	writer owns w_position, and each publishes its own with a release store, 
+	which the other side reads with an acquire load. 
+
+	A transfer that has to block, grow the buffer, or share its end, takes 
+	the pipe lock instead, and also excludes all lock-free transfers while 
+	it runs (but not while it sleeps): it increments @c slow, and waits for 
+	the fast_reader/fast_writer flags to clear. A lock-free transfer sets its 
+	flag and backs off if @c slow is non-zero.
+
+	A thread that sleeps on the pipe is counted in readers_waiting or 
+	writers_waiting before it lets lock-free transfers in, so a lock-free 
+	transfer that may let it proceed sees it, and signals it, holding the 
+	pipe lock.
+ */
+
+/* 
+	Start a lock-free transfer at one end, or return 0 if it must be locked. 
+	The end is also closed to lock-free transfers while a Splice pins it.
+ */
+static int pipe_fast_enter(pipe_cb* curPipe, FCB* end, int* fast, int* pinned)
+{
+	if(__atomic_load_n(&end->refcount, __ATOMIC_RELAXED) > 2)
 		return 0;
+
+	int idle = 0;
+	if(! __atomic_compare_exchange_n(fast, &idle, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return 0;
+	if(__atomic_load_n(&curPipe->slow, __ATOMIC_SEQ_CST) == 0
+		&& __atomic_load_n(pinned, __ATOMIC_SEQ_CST) == 0)
+		return 1;
+
+	__atomic_store_n(fast, 0, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+static inline void pipe_fast_exit(int* fast)
+{
+	__atomic_store_n(fast, 0, __ATOMIC_SEQ_CST);
+}
+
+/* Signal a condition of the pipe, from a lock-free transfer */
+static void pipe_fast_signal(pipe_cb* curPipe, CondVar* cv)
+{
+	Mutex_Lock(&curPipe->lock);
+	kernel_signal(cv);
+	Mutex_Unlock(&curPipe->lock);
+}
+
+/* 
+	Read without locking the pipe. Returns the number of bytes read, or 0 if
+	the read must be locked: the pipe is empty, or the fast path is not open.
+ */
+static int pipe_read_fast(pipe_cb* curPipe, char* buffer, unsigned int size)
+{
+	if(! pipe_fast_enter(curPipe, curPipe->reader, &curPipe->fast_reader, &curPipe->read_pinned))
+		return 0;
+
+	unsigned int avail = pipe_count(curPipe);
+	unsigned int n = (size < avail) ? size : avail;
+	int wake = 0;
+	if(n > 0) {
+		pipe_copy_out(curPipe, buffer, n);
+		wake = curPipe->limit - pipe_count(curPipe) >= pipe_low_water(curPipe);
 	}
+	pipe_fast_exit(&curPipe->fast_reader);
 
-	int i = 0;
-	for(i=0; i<size; i++){
+	if(wake && __atomic_load_n(&curPipe->writers_waiting, __ATOMIC_SEQ_CST) > 0)
+		pipe_fast_signal(curPipe, &curPipe->has_space);
+	return n;
+}
 
-		while(curPipe->writer!=NULL && curPipe->capacity == PIPE_BUFFER_SIZE-1){
-			kernel_broadcast(&curPipe->has_space);
-			kernel_wait(&curPipe->has_data,SCHED_PIPE);
-		}
+/* 
+	Write without locking the pipe. Returns the number of bytes written, or 
+	0 if the write must be locked: the data does not fit in the buffer, the
+	reader is closed, or the fast path is not open.
+ */
+static int pipe_write_fast(pipe_cb* curPipe, const char* buffer, unsigned int size)
+{
+	if(! pipe_fast_enter(curPipe, curPipe->writer, &curPipe->fast_writer, &curPipe->write_pinned))
+		return 0;
 
-	 	if(curPipe->writer==NULL && curPipe->capacity == PIPE_BUFFER_SIZE-1){
-			return i;
-		}
+	int n = 0;
+	unsigned int room = (curPipe->size < curPipe->limit) ? curPipe->size : curPipe->limit;
+	if(curPipe->reader != NULL && size <= room - pipe_count(curPipe)) {
+		pipe_copy_in(curPipe, buffer, size);
+		n = size;
+	}
+	pipe_fast_exit(&curPipe->fast_writer);
 
-		
-		buffer[i] = curPipe->BUFFER[curPipe->r_position];
+	if(n > 0 && __atomic_load_n(&curPipe->readers_waiting, __ATOMIC_SEQ_CST) > 0)
+		pipe_fast_signal(curPipe, &curPipe->has_data);
+	return n;
+}
 
-		curPipe->r_position = (curPipe->r_position + 1);
 
-		if(curPipe->r_position==PIPE_BUFFER_SIZE){
-			curPipe->r_position = 0;
-		}
+/* Exclude lock-free transfers, holding the pipe lock */
+static void pipe_exclude_fast(pipe_cb* curPipe)
+{
+	__atomic_add_fetch(&curPipe->slow, 1, __ATOMIC_SEQ_CST);
+	for(unsigned int spins=0; 
+		__atomic_load_n(&curPipe->fast_reader, __ATOMIC_SEQ_CST) 
+		|| __atomic_load_n(&curPipe->fast_writer, __ATOMIC_SEQ_CST); spins++) {
+		/* A preempted transfer needs a core to finish */
+		if(spins < PIPE_FAST_SPINS) cpu_relax(); else yield(SCHED_PIPE);
+	}
+}
+
+/* Lock the pipe and exclude lock-free transfers */
+static void pipe_lock(pipe_cb* curPipe)
+{
+	Mutex_Lock(&curPipe->lock);
+	pipe_exclude_fast(curPipe);
+}
+
+static void pipe_unlock(pipe_cb* curPipe)
+{
+	__atomic_sub_fetch(&curPipe->slow, 1, __ATOMIC_SEQ_CST);
+	Mutex_Unlock(&curPipe->lock);
+}
+
+/* 
+	Sleep on a condition of the locked pipe, counted in waiting. Lock-free 
+	transfers may proceed while we sleep.
+ */
+static void pipe_wait(pipe_cb* curPipe, CondVar* cv, unsigned int* waiting)
+{
+	__atomic_add_fetch(waiting, 1, __ATOMIC_SEQ_CST);
+	__atomic_sub_fetch(&curPipe->slow, 1, __ATOMIC_SEQ_CST);
+	kernel_wait_mutex(cv, &curPipe->lock, SCHED_PIPE);
+	pipe_exclude_fast(curPipe);
+	__atomic_sub_fetch(waiting, 1, __ATOMIC_SEQ_CST);
+}
+
+/* 
+	Called when the locked pipe is empty: release a buffer that was mostly 
+	unused since the last time, unless a Splice is using it.
+ */
+static void pipe_drained(pipe_cb* curPipe)
+{
+	if(curPipe->read_pinned || curPipe->write_pinned)
+		return;
+	if(curPipe->size > curPipe->limit 
+		|| (curPipe->size > PIPE_BUFFER_MIN && curPipe->peak <= curPipe->size/4))
+		pipe_resize(curPipe, 0);
+	curPipe->peak = 0;
+}
+
+/* 
+	Called after n bytes were taken out of the locked pipe, which had the 
+	given free space before.
+ */
+static void pipe_drawn(pipe_cb* curPipe, unsigned int space, unsigned int n)
+{
+	if(pipe_count(curPipe) == 0)
+		pipe_drained(curPipe);
+
+	/* Wake a writer when the space crosses the low watermark */
+	if(curPipe->writers_waiting > 0 && space < pipe_low_water(curPipe)
+		&& space + n >= pipe_low_water(curPipe))
+		kernel_signal(&curPipe->has_space);
+
+	/* Pass on the wakeup to the next reader, if there is data left */
+	if(curPipe->readers_waiting > 0 && pipe_count(curPipe) > 0)
+		kernel_signal(&curPipe->has_data);
+}
+
+/* 
+	Called after data was put into the locked pipe, which held count bytes 
+	before.
+ */
+static void pipe_filled(pipe_cb* curPipe, unsigned int count)
+{
+	/* Wake a reader when the pipe becomes non-empty */
+	if(curPipe->readers_waiting > 0 && count == 0)
+		kernel_signal(&curPipe->has_data);
+
+	/* Pass on the wakeup to the next writer, if there is space left */
+	if(curPipe->writers_waiting > 0 
+		&& curPipe->limit - pipe_count(curPipe) >= pipe_low_water(curPipe))
+		kernel_signal(&curPipe->has_space);
+}
 
-		curPipe->capacity++;
+/* 
+	Wait until the locked pipe is not full, and not pinned for writing by a
+	Splice, or its reader is closed. A full pipe is waited on until the free 
+	space reaches the low watermark (or fits size bytes), so that wakeups are 
+	batched. Returns the free space, or 0 if the reader is closed.
+ */
+static unsigned int pipe_wait_space(pipe_cb* curPipe, unsigned int size)
+{
+	int full = 0;
+	for(;;) {
+		if(curPipe->reader == NULL)
+			return 0;
+
+		unsigned int space = pipe_room(curPipe) - pipe_count(curPipe);
+		if(space == 0)
+			full = 1;
+
+		/* The limit may have changed */
+		unsigned int need = 1;
+		if(full)
+			need = (size < pipe_low_water(curPipe)) ? size : pipe_low_water(curPipe);
+
+		if(! curPipe->write_pinned && space >= need && space > 0)
+			return space;
+		pipe_wait(curPipe, &curPipe->has_space, &curPipe->writers_waiting);
 	}
+}
 
-	kernel_broadcast(&curPipe->has_space);
-	return i;
 
+/* 
+	Read from the pipe, holding the pipe lock. The reader blocks only while 
+	the pipe is empty, and then it takes as much as it can. 
+ */
+static int pipe_read_locked(pipe_cb* curPipe, char* buffer, unsigned int size)
+{
+	if(curPipe->reader == NULL){
+		return -1;
+	}
+
+	while(curPipe->read_pinned || (curPipe->writer!=NULL && pipe_count(curPipe) == 0)){
+		pipe_drained(curPipe);
+		pipe_wait(curPipe, &curPipe->has_data, &curPipe->readers_waiting);
+	}
+
+	//EOF
+	unsigned int avail = pipe_count(curPipe);
+	if(avail == 0){
+		return 0;
+	}
+
+	unsigned int n = (size < avail) ? size : avail;
+	unsigned int space = curPipe->limit - avail;
+	pipe_copy_out(curPipe, buffer, n);
+	pipe_drawn(curPipe, space, n);
+
+	return n;
 }
 
 
@@ -123,41 +505,52 @@ int pipe_write(void* this, const char* buffer, unsigned int size){
 
 	pipe_cb* curPipe = (pipe_cb*)this;
 	
-
-	if(curPipe==NULL || size<=0 || curPipe->writer == NULL || curPipe->reader == NULL){
+	if(curPipe==NULL || size<=0){
 		return -1;
 	}
 
-	int i = 0;
-	for(i=0; i<size; i++){
+	int i = pipe_write_fast(curPipe, buffer, size);
+	if(i > 0)
+		return i;
 
-		
-		while(curPipe->reader!=NULL && curPipe->capacity == 0){
-			kernel_broadcast(&curPipe->has_data);
-			kernel_wait(&curPipe->has_space,SCHED_PIPE);
-		}
+	pipe_lock(curPipe);
+	i = pipe_write_locked(curPipe, buffer, size);
+	pipe_unlock(curPipe);
+	return i;
+}
 
-		if(curPipe->writer == NULL || curPipe->reader == NULL){
-			return -1;
-		}	
 
-	 	if(curPipe->reader==NULL && curPipe->capacity == 0){
-			return i;
-		}
-		
-		curPipe->BUFFER[curPipe->w_position] = buffer[i];
+/* 
+	Write to the pipe, holding the pipe lock. The writer moves as much as 
+	there is room for at a time, until all the data is written. When the 
+	pipe is full, it blocks until the free space reaches the low watermark
+	(or fits the rest of the data), so that wakeups are batched.
+ */
+static int pipe_write_locked(pipe_cb* curPipe, const char* buffer, unsigned int size)
+{
+	if(curPipe->writer == NULL || curPipe->reader == NULL){
+		return -1;
+	}
 
-		curPipe->w_position = (curPipe->w_position+1);
+	unsigned int count = 0;
+	while(count < size){
 
-		if(curPipe->w_position == PIPE_BUFFER_SIZE){
-			curPipe->w_position = 0;
-		}
+		unsigned int space = pipe_wait_space(curPipe, size - count);
+		if(curPipe->writer == NULL || space == 0){
+			return -1;
+		}	
 
-		curPipe->capacity--;
+		unsigned int n = size - count;
+		if(n > space) n = space;
+
+		unsigned int held = pipe_count(curPipe);
+		pipe_grow(curPipe, n);
+		pipe_copy_in(curPipe, buffer + count, n);
+		pipe_filled(curPipe, held);
+		count += n;
 	}
-	
-	kernel_broadcast(&curPipe->has_data);
-	return i;
+
+	return count;
 }
 
 
@@ -167,27 +560,289 @@ int pipe_close_reader(void* this){
 
 	pipe_cb* curPipe = (pipe_cb*)this;
 
-	if(curPipe==NULL || curPipe->reader == NULL){
+	if(curPipe==NULL){
 		return -1;
 	}
-	
-	curPipe->reader=NULL;
 
-	return 0;
+	pipe_lock(curPipe);
+	int retval = -1;
+	if(curPipe->reader != NULL){
+		curPipe->reader=NULL;
+		/* Writers waiting for space must find out */
+		kernel_broadcast(&curPipe->has_space);
+		retval = 0;
+	}
+	int unused = (curPipe->writer == NULL);
+	pipe_unlock(curPipe);
+
+	if(unused) pipe_free(curPipe);
+	return retval;
 }
 
 
 int pipe_close_writer(void* this){
 
 	pipe_cb* curPipe = (pipe_cb*)this;
-	if(curPipe==NULL || curPipe->writer == NULL){
+	if(curPipe==NULL){
 		return -1;
 	}
 
-	curPipe->writer=NULL;
-	if(curPipe->reader!=NULL){
+	pipe_lock(curPipe);
+	int retval = -1;
+	if(curPipe->writer != NULL){
+		curPipe->writer=NULL;
+		if(curPipe->reader!=NULL){
+			kernel_broadcast(&curPipe->has_data);
+		}
+		retval = 0;
+	}
+	int unused = (curPipe->reader == NULL);
+	pipe_unlock(curPipe);
+
+	if(unused) pipe_free(curPipe);
+	return retval;
+}
+
+
+int sys_PipeSetCapacity(Fid_t fid, unsigned int size)
+{
+	FCB* fcb = get_fcb(fid);
+	if(fcb == NULL)
+		return -1;
+
+	int retval = -1;
+	if(fcb->streamfunc == &readOperations || fcb->streamfunc == &writeOperations) {
+		pipe_cb* curPipe = fcb->streamobj;
+		unsigned int limit = (size <= PIPE_BUFFER_MAX) ? pipe_fit(size) : 0;
+
+		pipe_lock(curPipe);
+		if(limit > 0 && pipe_count(curPipe) <= limit) {
+			/* A pinned buffer is shrunk when it is next drained */
+			if(curPipe->size > limit && ! curPipe->read_pinned && ! curPipe->write_pinned)
+				pipe_resize(curPipe, limit);
+			/* The watermark moves, so blocked writers must re-check */
+			if(limit != curPipe->limit)
+				kernel_broadcast(&curPipe->has_space);
+			curPipe->limit = limit;
+			retval = limit;
+		}
+		pipe_unlock(curPipe);
+	}
+
+	FCB_decref(fcb);
+	return retval;
+}
+
+
+/*
+	Splice and Tee.
+
+	These move data between a pipe buffer and another stream without a 
+	buffer in between: from ring to ring when both are pipes, else straight
+	from the ring into the Write of the output stream, or from the Read of 
+	the input stream into the ring. 
+
+	The call to the other stream may block for long, so it is made with the 
+	pipe unlocked, and the part of the ring it uses pinned: read_pinned for 
+	the data at r_position, or write_pinned for the space at w_position. 
+	While the data is pinned, other readers wait, and the buffer is not 
+	moved (it does not grow or shrink); while the space is pinned, other 
+	writers wait, and the buffer is not shrunk. Either way, the other end 
+	of the pipe goes on, lock-free or not, and can be closed.
+ */
+
+/*
+	Move (or copy, if consume is 0) up to size bytes from the in pipe to the 
+	out pipe. Both pipes are locked, in address order. To block, on data in 
+	the one or space in the other, only that pipe stays locked, and after 
+	waking up we start over.
+ */
+static int pipe_transfer(pipe_cb* in, pipe_cb* out, unsigned int size, int consume)
+{
+	if(in == out)
+		return -1;
+
+	pipe_cb* first = (in < out) ? in : out;
+	pipe_cb* second = (in < out) ? out : in;
+
+	int retval;
+	for(;;) {
+		pipe_lock(first);
+		pipe_lock(second);
+
+		unsigned int avail = pipe_count(in);
+		unsigned int space = pipe_room(out) - pipe_count(out);
+
+		if(out->reader == NULL) {
+			retval = -1;
+			break;
+		}
+		if(avail == 0 && in->writer == NULL && ! in->read_pinned) {
+			retval = 0;
+			break;
+		}
+		if(avail == 0 || in->read_pinned) {
+			pipe_unlock(out);
+			pipe_wait(in, &in->has_data, &in->readers_waiting);
+			pipe_unlock(in);
+			continue;
+		}
+		if(space == 0 || out->write_pinned) {
+			/* Let other readers of the in pipe proceed meanwhile */
+			pipe_drawn(in, in->limit - avail, 0);
+			pipe_unlock(in);
+			pipe_wait_space(out, size);
+			pipe_unlock(out);
+			continue;
+		}
+
+		unsigned int n = size;
+		if(n > avail) n = avail;
+		if(n > space) n = space;
+
+		unsigned int held = pipe_count(out);
+		pipe_grow(out, n);
+		for(unsigned int done = 0; done < n; ) {
+			unsigned int len;
+			char* chunk = pipe_space_chunk(out, &len);
+			if(len > n - done) len = n - done;
+			pipe_peek(in, done, chunk, len);
+			pipe_produce(out, len);
+			done += len;
+		}
+		pipe_filled(out, held);
+
+		if(consume)
+			pipe_consume(in, n);
+		pipe_drawn(in, in->limit - avail, consume ? n : 0);
+
+		retval = n;
+		break;
+	}
+
+	pipe_unlock(second);
+	pipe_unlock(first);
+	return retval;
+}
+
+
+/* 
+	Called after a Splice unpins the locked pipe. Whoever waited on the pin 
+	(rather than on the data or the space) is woken up to check again.
+ */
+static void pipe_unpinned(pipe_cb* curPipe)
+{
+	if(curPipe->readers_waiting > 0)
 		kernel_broadcast(&curPipe->has_data);
+	if(curPipe->writers_waiting > 0)
+		kernel_broadcast(&curPipe->has_space);
+}
+
+
+/* Move up to size bytes from the in pipe to the Write of a stream */
+static int pipe_splice_out(pipe_cb* in, FCB* out, unsigned int size)
+{
+	pipe_lock(in);
+
+	while(in->read_pinned || (in->writer!=NULL && pipe_count(in) == 0)){
+		pipe_drained(in);
+		pipe_wait(in, &in->has_data, &in->readers_waiting);
 	}
 
-	return 0;
-}
\ No newline at end of file
+	int retval = 0;
+	if(pipe_count(in) > 0) {
+		unsigned int len;
+		char* chunk = pipe_data_chunk(in, &len);
+		if(len > size) len = size;
+
+		in->read_pinned = 1;
+		pipe_unlock(in);
+		retval = out->streamfunc->Write(out->streamobj, chunk, len);
+		pipe_lock(in);
+		in->read_pinned = 0;
+
+		unsigned int space = in->limit - pipe_count(in);
+		if(retval > 0) {
+			pipe_consume(in, retval);
+			pipe_drawn(in, space, retval);
+		}
+		pipe_unpinned(in);
+	}
+
+	pipe_unlock(in);
+	return retval;
+}
+
+
+/* Move up to size bytes from the Read of a stream to the out pipe */
+static int pipe_splice_in(FCB* in, pipe_cb* out, unsigned int size)
+{
+	pipe_lock(out);
+
+	int retval = -1;
+	unsigned int space = pipe_wait_space(out, size);
+	if(space > 0) {
+		unsigned int n = (size < space) ? size : space;
+		pipe_grow(out, n);
+
+		unsigned int len;
+		char* chunk = pipe_space_chunk(out, &len);
+		if(len > n) len = n;
+
+		out->write_pinned = 1;
+		pipe_unlock(out);
+		retval = in->streamfunc->Read(in->streamobj, chunk, len);
+		pipe_lock(out);
+		out->write_pinned = 0;
+
+		/* The reader may have been closed meanwhile */
+		if(out->reader == NULL)
+			retval = -1;
+		if(retval > 0) {
+			unsigned int held = pipe_count(out);
+			pipe_produce(out, retval);
+			pipe_filled(out, held);
+		}
+		pipe_unpinned(out);
+	}
+
+	pipe_unlock(out);
+	return retval;
+}
+
+
+int sys_Splice(Fid_t in, Fid_t out, unsigned int size)
+{
+	FCB* fin = get_fcb(in);
+	FCB* fout = get_fcb(out);
+
+	int retval = -1;
+	if(fin != NULL && fout != NULL && size > 0) {
+		if(fin->streamfunc == &readOperations && fout->streamfunc == &writeOperations)
+			retval = pipe_transfer(fin->streamobj, fout->streamobj, size, 1);
+		else if(fin->streamfunc == &readOperations && fout->streamfunc->Write != NULL)
+			retval = pipe_splice_out(fin->streamobj, fout, size);
+		else if(fout->streamfunc == &writeOperations && fin->streamfunc->Read != NULL)
+			retval = pipe_splice_in(fin, fout->streamobj, size);
+	}
+
+	if(fin) FCB_decref(fin);
+	if(fout) FCB_decref(fout);
+	return retval;
+}
+
+
+int sys_Tee(Fid_t in, Fid_t out, unsigned int size)
+{
+	FCB* fin = get_fcb(in);
+	FCB* fout = get_fcb(out);
+
+	int retval = -1;
+	if(fin != NULL && fout != NULL && size > 0
+		&& fin->streamfunc == &readOperations && fout->streamfunc == &writeOperations)
+		retval = pipe_transfer(fin->streamobj, fout->streamobj, size, 0);
+
+	if(fin) FCB_decref(fin);
+	if(fout) FCB_decref(fout);
+	return retval;
+}
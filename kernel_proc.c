@@ -20,6 +20,9 @@
 PCB PT[MAX_PROC];
 unsigned int process_count;
 
+/* The process table lock */
+Mutex proc_table_lock = MUTEX_INIT;
+
 PCB* get_pcb(Pid_t pid)
 {
   return PT[pid].pstate==FREE ? NULL : &PT[pid];
@@ -77,7 +80,7 @@ void initialize_processes()
 
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_table_lock held
 */
 PCB* acquire_PCB()
 {
@@ -94,7 +97,7 @@ PCB* acquire_PCB()
 }
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_table_lock held
 */
 void release_PCB(PCB* pcb)
 {
@@ -135,8 +138,21 @@ void start_main_thread()
 	System call to create a new process.
  */
 Pid_t sys_Exec(Task call, int argl, void* args)
+{
+  return sys_ExecEx(call, argl, args, NULL);
+}
+
+
+/*
+	System call to create a new process, with attributes for the main thread.
+ */
+Pid_t sys_ExecEx(Task call, int argl, void* args, const thread_attr* attr)
 {
   PCB *curproc, *newproc;
+
+  if(! thread_attr_valid(attr)) return NOPROC;
+
+  Mutex_Lock(&proc_table_lock);
   
   /* The new process PCB */
   newproc = acquire_PCB();
@@ -158,11 +174,7 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     rlist_push_front(& curproc->children_list, & newproc->children_node);
 
     /* Inherit file streams from parent */
-    for(int i=0; i<MAX_FILEID; i++) {
-       newproc->FIDT[i] = curproc->FIDT[i];
-       if(newproc->FIDT[i])
-          FCB_incref(newproc->FIDT[i]);
-    }
+    FCB_copy_table(curproc, newproc);
   }
 
 
@@ -187,7 +199,7 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     PTCB* ptcb = spawn_ptcb(newproc);
     ASSERT(ptcb!=NULL);
 
-    TCB* main_thread = spawn_thread(newproc, ptcb, start_main_thread);
+    TCB* main_thread = spawn_thread(newproc, ptcb, start_main_thread, attr);
     
     ptcb->task = call;
     ptcb->argl = argl;
@@ -215,6 +227,7 @@ Pid_t sys_Exec(Task call, int argl, void* args)
 
 
 finish:
+  Mutex_Unlock(&proc_table_lock);
   return get_pid(newproc);
 }
 
@@ -228,7 +241,18 @@ Pid_t sys_GetPid()
 
 Pid_t sys_GetPPid()
 {
-  return get_pid(CURPROC->parent);
+  /* The parent may change, when it exits */
+  Mutex_Lock(&proc_table_lock);
+  Pid_t ppid = get_pid(CURPROC->parent);
+  Mutex_Unlock(&proc_table_lock);
+  return ppid;
+}
+
+
+/* System call */
+unsigned long sys_GetTime()
+{
+  return bios_clock();
 }
 
 
@@ -263,7 +287,7 @@ static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
 
   /* Ok, child is a legal child of mine. Wait for it to exit. */
   while(child->pstate == ALIVE)
-    kernel_wait(& parent->child_exit, SCHED_USER);
+    kernel_wait_mutex(& parent->child_exit, &proc_table_lock, SCHED_USER);
   
   cleanup_zombie(child, status);
   
@@ -285,7 +309,7 @@ static Pid_t wait_for_any_child(int* status)
   }
 
   while(is_rlist_empty(& parent->exited_list)) {
-    kernel_wait(& parent->child_exit, SCHED_USER);
+    kernel_wait_mutex(& parent->child_exit, &proc_table_lock, SCHED_USER);
   }
 
   PCB* child = parent->exited_list.next->pcb;
@@ -300,15 +324,19 @@ finish:
 
 Pid_t sys_WaitChild(Pid_t cpid, int* status)
 {
+  Mutex_Lock(&proc_table_lock);
+
   /* Wait for specific child. */
   if(cpid != NOPROC) {
-    return wait_for_specific_child(cpid, status);
+    cpid = wait_for_specific_child(cpid, status);
   }
   /* Wait for any child */
   else {
-    return wait_for_any_child(status);
+    cpid = wait_for_any_child(status);
   }
 
+  Mutex_Unlock(&proc_table_lock);
+  return cpid;
 }
 
 
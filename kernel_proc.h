@@ -65,6 +65,17 @@ typedef struct process_control_block {
 
 } PCB;
 
+/**
+  @brief The process table lock.
+
+  This lock protects the process table, i.e., the allocation of PCBs and the
+  fields of all PCBs, except for the fid tables (which are protected by the
+  file table lock, see kernel_streams.h). It also protects the PTCBs of all 
+  processes. Waiting for a child process or a thread is done on this lock,
+  by @c kernel_wait_mutex().
+ */
+extern Mutex proc_table_lock;
+
 /**
  * @brief Initialize a PTCB.
  * 
@@ -16,8 +16,8 @@
 	Core table and CCB-related declarations.
  *********************************************/
 
-/* Core control blocks */
-CCB cctx[MAX_CORES];
+/* Core control blocks, allocated by initialize_scheduler() */
+CCB* cctx = NULL;
 
 
 /* 
@@ -34,8 +34,13 @@ CCB cctx[MAX_CORES];
 #define CURTHREAD (CURCORE.current_thread)
 
 
-#define MAX_QUEUE_NUMBER 30
 #define CALL_LIMIT 7000
+
+/* The occupancy bitmap of a run queue must fit in an unsigned int */
+_Static_assert(MAX_QUEUE_NUMBER <= 8 * sizeof(unsigned int), "too many priority levels");
+
+/* The highest bit set in a non-zero bitmap */
+#define HIGHEST_BIT(mask) (8 * (int)sizeof(unsigned int) - 1 - __builtin_clz(mask))
 /*
 	This can be used in the preemptive context to
 	obtain the current thread.
@@ -78,8 +83,6 @@ TCB* cur_thread()
   with the exception of idle threads (they don't count).
  */
 volatile unsigned int active_threads = 0;
-Mutex active_threads_spinlock = MUTEX_INIT;
-int yield_calls = 0;
 
 /* This is specific to Intel Pentium! */
 #define SYSTEM_PAGE_SIZE (1 << 12)
@@ -88,43 +91,191 @@ int yield_calls = 0;
 #define THREAD_TCB_SIZE \
 	(((sizeof(TCB) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
+/*
+  A thread block holds the stack of a thread, with its TCB on top:
+
+      [ guard | stack ..................... | TCB ]
+                          grows down <----
+
+  so that a stack overflow runs into the guard page, and is detected as a
+  seg.fault instead of silently corrupting memory.
+ */
+#define thread_stack(tcb, stack_size) (((void*)(tcb)) - (stack_size))
 
-//#define MMAPPED_THREAD_MEM
+#define MMAPPED_THREAD_MEM
 #ifdef MMAPPED_THREAD_MEM
 
+#define THREAD_GUARD_SIZE SYSTEM_PAGE_SIZE
+
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
+  Use mmap to allocate a thread. The block is only reserved; the host commits
+  each page when it is first touched, so a thread only consumes the stack pages
+  it actually uses. The stack is executable, because GCC places the trampolines
+  of nested functions on it.
  */
-void free_thread(void* ptr, size_t size) { CHECK(munmap(ptr, size)); }
-
-void* allocate_thread(size_t size)
+TCB* allocate_thread(size_t stack_size)
 {
+	size_t size = THREAD_GUARD_SIZE + stack_size + THREAD_TCB_SIZE;
 	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
 
 	CHECK((ptr == MAP_FAILED) ? -1 : 0);
+	CHECK(mprotect(ptr, THREAD_GUARD_SIZE, PROT_NONE));
+
+	return ptr + THREAD_GUARD_SIZE + stack_size;
+}
+
+void free_thread(TCB* tcb, size_t stack_size)
+{
+	CHECK(munmap(thread_stack(tcb, stack_size) - THREAD_GUARD_SIZE,
+		THREAD_GUARD_SIZE + stack_size + THREAD_TCB_SIZE));
+}
 
-	return ptr;
+/* Return the stack pages of an unused thread block to the host */
+static void discard_thread_stack(TCB* tcb, size_t stack_size)
+{
+	CHECK(madvise(thread_stack(tcb, stack_size), stack_size, MADV_DONTNEED));
 }
 #else
 /*
   Use malloc to allocate a thread. This is probably faster than  mmap, but
   cannot be made easily to 'detect' stack overflow.
  */
-void free_thread(void* ptr, size_t size) { free(ptr); }
-
-void* allocate_thread(size_t size)
+TCB* allocate_thread(size_t stack_size)
 {
-	void* ptr = aligned_alloc(SYSTEM_PAGE_SIZE, size);
+	void* ptr = aligned_alloc(SYSTEM_PAGE_SIZE, stack_size + THREAD_TCB_SIZE);
 	CHECK((ptr == NULL) ? -1 : 0);
-	return ptr;
+	return ptr + stack_size;
 }
+
+void free_thread(TCB* tcb, size_t stack_size) { free(thread_stack(tcb, stack_size)); }
+
+static void discard_thread_stack(TCB* tcb, size_t stack_size) { }
 #endif
 
 
+/*
+  Thread block pool.
+
+  Exiting threads do not return their block to the host allocator. The
+  block is pushed to the free list of the core's thread_cache, which is
+  only accessed by that core in a non-preemptive context, and therefore
+  needs no locking. When a cache runs empty, it is refilled with a batch
+  of blocks from the global THREAD_DEPOT; when it grows over
+  THREAD_CACHE_MAX, a batch is moved to the depot. The host allocator is
+  used only when both are empty, or when the depot is full.
+ */
+#define THREAD_CACHE_BATCH 8
+#define THREAD_CACHE_MAX (2 * THREAD_CACHE_BATCH)
+#define THREAD_DEPOT_MAX 64
+
+/* A free thread block is linked through its first word */
+typedef struct free_thread_block {
+	struct free_thread_block* next;
+} free_thread_block;
+
+static struct {
+	mcs_lock lock;
+	free_thread_block* free;
+	unsigned int size;
+} THREAD_DEPOT = { MCS_LOCK_INIT, NULL, 0 };
+
+/* Move up to n blocks from list *from to list *to */
+static unsigned int move_thread_blocks(void** from, void** to, unsigned int n)
+{
+	unsigned int moved = 0;
+	for (; moved < n && *from != NULL; moved++) {
+		free_thread_block* b = *from;
+		*from = b->next;
+		b->next = *to;
+		*to = b;
+	}
+	return moved;
+}
+
+static TCB* pool_allocate_thread()
+{
+	int preempt = preempt_off;
+	thread_cache* tc = &CURCORE.thread_cache;
+
+	if (tc->free == NULL && __atomic_load_n(&THREAD_DEPOT.free, __ATOMIC_RELAXED) != NULL) {
+		mcs_node qn;
+		mcs_lock_acquire(&THREAD_DEPOT.lock, &qn);
+		unsigned int n = move_thread_blocks((void**)&THREAD_DEPOT.free, &tc->free, THREAD_CACHE_BATCH);
+		THREAD_DEPOT.size -= n;
+		mcs_lock_release(&THREAD_DEPOT.lock, &qn);
+		tc->size += n;
+	}
+
+	TCB* tcb;
+	if (tc->free != NULL) {
+		free_thread_block* b = tc->free;
+		tc->free = b->next;
+		tc->size--;
+		tc->hits++;
+		tcb = (TCB*)b;
+	} else {
+		tc->misses++;
+		tcb = allocate_thread(THREAD_STACK_SIZE);
+	}
+
+	if (preempt)
+		preempt_on;
+	return tcb;
+}
+
+static void free_thread_list(void* list)
+{
+	while (list != NULL) {
+		free_thread_block* b = list;
+		list = b->next;
+		free_thread((TCB*)b, THREAD_STACK_SIZE);
+	}
+}
+
+/*
+  This is called with sched_spinlock locked !
+ */
+static void pool_free_thread(TCB* tcb)
+{
+	thread_cache* tc = &CURCORE.thread_cache;
+
+	free_thread_block* b = (free_thread_block*)tcb;
+	b->next = tc->free;
+	tc->free = b;
+	tc->size++;
+
+	if (tc->size > THREAD_CACHE_MAX) {
+		/* Spill a batch, without the stack pages it occupies */
+		void* batch = NULL;
+		tc->size -= move_thread_blocks(&tc->free, &batch, THREAD_CACHE_BATCH);
+		for (free_thread_block* e = batch; e != NULL; e = e->next)
+			discard_thread_stack((TCB*)e, THREAD_STACK_SIZE);
+
+		mcs_node qn;
+		mcs_lock_acquire(&THREAD_DEPOT.lock, &qn);
+		unsigned int room = THREAD_DEPOT_MAX - THREAD_DEPOT.size;
+		THREAD_DEPOT.size += move_thread_blocks(&batch, (void**)&THREAD_DEPOT.free,
+			(room < THREAD_CACHE_BATCH) ? room : THREAD_CACHE_BATCH);
+		mcs_lock_release(&THREAD_DEPOT.lock, &qn);
+
+		/* The depot is full, give the rest of the batch back to the host */
+		free_thread_list(batch);
+	}
+}
+
+void get_thread_pool_stats(thread_pool_stats* stats)
+{
+	stats->hits = stats->misses = 0;
+	stats->cached = 0;
+	for (uint c = 0; c < cpu_cores(); c++) {
+		thread_cache* tc = &cctx[c].thread_cache;
+		stats->hits += __atomic_load_n(&tc->hits, __ATOMIC_RELAXED);
+		stats->misses += __atomic_load_n(&tc->misses, __ATOMIC_RELAXED);
+		stats->cached += __atomic_load_n(&tc->size, __ATOMIC_RELAXED);
+	}
+	stats->depot = __atomic_load_n(&THREAD_DEPOT.size, __ATOMIC_RELAXED);
+}
 
 
 /*
@@ -142,20 +293,41 @@ static void thread_start()
 	assert(0);
 }
 
+int thread_attr_valid(const thread_attr* attr)
+{
+	if (attr == NULL)
+		return 1;
+	if (attr->stack_size != 0 && (attr->stack_size < THREAD_MIN_STACK_SIZE || attr->stack_size > THREAD_MAX_STACK_SIZE))
+		return 0;
+	if (attr->priority != THREAD_DEFAULT_PRIORITY && (attr->priority < 0 || attr->priority >= MAX_QUEUE_NUMBER))
+		return 0;
+	return 1;
+}
+
 /*
   Initialize and return a new TCB
 */
 
-TCB* spawn_thread(PCB* pcb, PTCB* ptcb, void (*func)())
+TCB* spawn_thread(PCB* pcb, PTCB* ptcb, void (*func)(), const thread_attr* attr)
 {
-	/* The allocated thread size must be a multiple of page size */
-	TCB* tcb = (TCB*)allocate_thread(THREAD_SIZE);
+	assert(thread_attr_valid(attr));
+
+	/* The stack size must be a multiple of page size */
+	size_t stack_size = (attr != NULL && attr->stack_size != 0)
+		? ((attr->stack_size + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE
+		: THREAD_STACK_SIZE;
+
+	/* Only blocks of the default size are pooled */
+	TCB* tcb = (stack_size == THREAD_STACK_SIZE) 
+		? pool_allocate_thread() : allocate_thread(stack_size);
 
 	/* Set the owner */
 	tcb->owner_pcb = pcb;
 	tcb->ptcb = ptcb;
 	ptcb->tcb = tcb;
-	tcb->priority = MAX_QUEUE_NUMBER/2;
+	tcb->priority = (attr != NULL && attr->priority != THREAD_DEFAULT_PRIORITY)
+		? attr->priority : MAX_QUEUE_NUMBER/2;
+	tcb->stack_size = stack_size;
 
 	/* Initialize the other attributes */
 	tcb->type = NORMAL_THREAD;
@@ -164,6 +336,11 @@ TCB* spawn_thread(PCB* pcb, PTCB* ptcb, void (*func)())
 	tcb->thread_func = func;
 	tcb->wakeup_time = NO_TIMEOUT;
 	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
+	tcb->base_priority = tcb->priority;
+	tcb->donee = NULL;
+	rlnode_init(&tcb->donor_node, tcb);
+	rlnode_init(&tcb->donors, NULL);
+	tcb->runq = NULL;
 
 	tcb->its = QUANTUM;
 	tcb->rts = QUANTUM;
@@ -171,19 +348,17 @@ TCB* spawn_thread(PCB* pcb, PTCB* ptcb, void (*func)())
 	tcb->curr_cause = SCHED_IDLE;
 
 	/* Compute the stack segment address and size */
-	void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+	void* sp = thread_stack(tcb, stack_size);
 
 	/* Init the context */
-	cpu_initialize_context(&tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+	cpu_initialize_context(&tcb->context, sp, stack_size, thread_start);
 
 #ifndef NVALGRIND
-	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + THREAD_STACK_SIZE);
+	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + stack_size);
 #endif
 
 	/* increase the count of active threads */
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads++;
-	Mutex_Unlock(&active_threads_spinlock);
+	__atomic_add_fetch(&active_threads, 1, __ATOMIC_RELAXED);
 
 	return tcb;
 }
@@ -197,11 +372,53 @@ void release_TCB(TCB* tcb)
 	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
 #endif
 
-	free_thread(tcb, THREAD_SIZE);
+	if (tcb->stack_size == THREAD_STACK_SIZE)
+		pool_free_thread(tcb);
+	else
+		free_thread(tcb, tcb->stack_size);
+
+	__atomic_sub_fetch(&active_threads, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ *
+ * MCS locks
+ *
+ */
+
+/*
+  A core appends its node to the queue by swapping it into the tail. If
+  there was a predecessor, the core links itself behind it and spins on
+  its own node, until the predecessor clears the flag when it releases the
+  lock. On release, a holder without a successor tries to reset the tail
+  to NULL; if this fails, a successor is in the middle of linking itself,
+  and the holder waits for the link to appear.
+*/
+void mcs_lock_acquire(mcs_lock* lock, mcs_node* node)
+{
+	node->next = NULL;
+	node->locked = 1;
+
+	mcs_node* pred = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+	if (pred != NULL) {
+		__atomic_store_n(&pred->next, node, __ATOMIC_RELEASE);
+		while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+			cpu_relax();
+	}
+}
 
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads--;
-	Mutex_Unlock(&active_threads_spinlock);
+void mcs_lock_release(mcs_lock* lock, mcs_node* node)
+{
+	mcs_node* succ = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+	if (succ == NULL) {
+		mcs_node* expected = node;
+		if (__atomic_compare_exchange_n(&lock->tail, &expected, NULL, 0,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+		while ((succ = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL)
+			cpu_relax();
+	}
+	__atomic_store_n(&succ->locked, 0, __ATOMIC_RELEASE);
 }
 
 /*
@@ -215,16 +432,41 @@ void release_TCB(TCB* tcb)
  */
 
 /*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
-  Both of these structures are protected by @c sched_spinlock.
+  The ready threads are kept in run queues (see sched_queue), with one
+  doubly linked list per priority level. Under SCHED_GLOBAL_QUEUE all cores
+  share GLOBAL_RUNQ, under SCHED_PERCORE_QUEUES each core uses the run queue
+  in its CCB. Each run queue is protected by its own spinlock.
+
+  Also, the scheduler keeps the sleeping threads with a timeout in
+  TIMER_WHEEL. The timer wheel, as well as the state of every TCB,
+  is protected by @c sched_spinlock. When both are needed, 
+  @c sched_spinlock is locked before the run queue lock.
+
+  All the scheduler locks are MCS locks (see mcs_lock), so that cores
+  contending for them are served in order, each spinning on its own node.
+*/
+
+sched_policy scheduler_policy = SCHED_GLOBAL_QUEUE;
+sched_queue GLOBAL_RUNQ; /* The run queue under SCHED_GLOBAL_QUEUE */
+static mcs_lock sched_spinlock = MCS_LOCK_INIT; /* spinlock for thread state and timeouts */
+
+/*
+  The timer wheel is a hashed array of lists of sleeping threads. Time is
+  divided in ticks of TIMER_WHEEL_TICK usec, and a thread whose wakeup time
+  falls in tick t is kept in slot (t % TIMER_WHEEL_SLOTS). Thus, registering
+  and cancelling a timeout are O(1). Timeouts more than a full rotation in
+  the future share a slot with nearer ones, and are skipped until their
+  round comes.
 */
+#define TIMER_WHEEL_TICK 1000
+#define TIMER_WHEEL_SLOTS 512
 
-rlnode SCHED[MAX_QUEUE_NUMBER]; /* The scheduler queue */
-rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
+static struct {
+	rlnode slot[TIMER_WHEEL_SLOTS]; /* The lists of threads per slot */
+	TimerDuration tick; /* The last tick that was processed */
+	unsigned int count; /* The number of threads in the wheel */
+	TimerDuration next; /* No timeout expires before this time */
+} TIMER_WHEEL;
 
 /* Interrupt handler for ALARM */
 void yield_handler() { yield(SCHED_QUANTUM); }
@@ -235,7 +477,7 @@ void ici_handler()
 }
 
 /*
-  Possibly add TCB to the scheduler timeout list.
+  Possibly add TCB to the scheduler timer wheel.
   *** MUST BE CALLED WITH sched_spinlock HELD ***
 */
 static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
@@ -243,32 +485,139 @@ static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
 	if (timeout != NO_TIMEOUT) {
 		/* set the wakeup time */
 		TimerDuration curtime = bios_clock();
-		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
-
-		/* add to the TIMEOUT_LIST in sorted order */
-		rlnode* n = TIMEOUT_LIST.next;
-		for (; n != &TIMEOUT_LIST; n = n->next)
-			/* skip earlier entries */
-			if (tcb->wakeup_time < n->tcb->wakeup_time)
-				break;
-		/* insert before n */
-		rl_splice(n->prev, &tcb->sched_node);
+		tcb->wakeup_time = curtime + timeout;
+
+		/* add to the slot of the wakeup tick */
+		TimerDuration tick = tcb->wakeup_time / TIMER_WHEEL_TICK;
+		rlist_push_back(&TIMER_WHEEL.slot[tick % TIMER_WHEEL_SLOTS], &tcb->sched_node);
+		TIMER_WHEEL.count++;
+		if (tcb->wakeup_time < TIMER_WHEEL.next)
+			TIMER_WHEEL.next = tcb->wakeup_time;
 	}
 }
 
 /*
-  Add TCB to the end of the scheduler list.
+  Initialize an empty run queue.
+*/
+static void sched_queue_init(sched_queue* q)
+{
+	q->lock = (mcs_lock) MCS_LOCK_INIT;
+	for (int i = 0; i < MAX_QUEUE_NUMBER; i++)
+		rlnode_init(&q->level[i], NULL);
+	q->occupied = 0;
+	q->count = 0;
+	q->yield_calls = 0;
+}
+
+/*
+  Add TCB to the end of the current core's run queue.
   *** MUST BE CALLED WITH sched_spinlock HELD ***
 */
 static void sched_queue_add(TCB* tcb)
 {
+	sched_queue* q = CURCORE.runq;
+
 	/* Insert at the end of the scheduling list */
-	rlist_push_back(&SCHED[tcb->priority], &tcb->sched_node);
+	mcs_node qn;
+	mcs_lock_acquire(&q->lock, &qn);
+	rlist_push_back(&q->level[tcb->priority], &tcb->sched_node);
+	q->occupied |= 1u << tcb->priority;
+	tcb->runq = q;
+	__atomic_store_n(&q->count, q->count + 1, __ATOMIC_RELAXED);
+	mcs_lock_release(&q->lock, &qn);
 
 	/* Restart possibly halted cores */
 	cpu_core_restart_one();
 }
 
+/*
+  Remove and return the highest-priority thread of a run queue,
+  or NULL if the queue is empty.
+  *** MUST BE CALLED WITH q->lock HELD ***
+*/
+static TCB* sched_queue_pop(sched_queue* q)
+{
+	if (q->occupied == 0)
+		return NULL;
+
+	int i = HIGHEST_BIT(q->occupied);
+	TCB* tcb = rlist_pop_front(&q->level[i])->tcb;
+	if (is_rlist_empty(&q->level[i]))
+		q->occupied &= ~(1u << i);
+	tcb->runq = NULL;
+
+	__atomic_store_n(&q->count, q->count - 1, __ATOMIC_RELAXED);
+	return tcb;
+}
+
+/*
+  Move a queued thread to another priority level of its run queue.
+  *** MUST BE CALLED WITH q->lock HELD ***
+*/
+static void sched_queue_move(sched_queue* q, TCB* tcb, int priority)
+{
+	rlist_remove(&tcb->sched_node);
+	if (is_rlist_empty(&q->level[tcb->priority]))
+		q->occupied &= ~(1u << tcb->priority);
+
+	tcb->priority = priority;
+	rlist_push_back(&q->level[priority], &tcb->sched_node);
+	q->occupied |= 1u << priority;
+}
+
+/*
+  Move every queued thread to the highest priority level.
+  *** MUST BE CALLED WITH q->lock HELD ***
+*/
+static void boost(sched_queue* q)
+{
+	const unsigned int topbit = 1u << (MAX_QUEUE_NUMBER - 1);
+	rlnode* top = &q->level[MAX_QUEUE_NUMBER - 1];
+
+	/* Walk the occupied levels downwards, so that higher priorities stay in front */
+	for (unsigned int lower = q->occupied & ~topbit; lower != 0;) {
+		int i = HIGHEST_BIT(lower);
+		rlnode* lvl = &q->level[i];
+		for (rlnode* n = lvl->next; n != lvl; n = n->next)
+			n->tcb->priority = n->tcb->base_priority = MAX_QUEUE_NUMBER - 1;
+		rlist_append(top, lvl);
+		lower &= ~(1u << i);
+	}
+	if (q->occupied)
+		q->occupied = topbit;
+	q->yield_calls = 0;
+}
+
+/*
+  Steal the highest-priority thread of the busiest peer run queue.
+  Return NULL if all peers are empty.
+  This is only used under SCHED_PERCORE_QUEUES.
+*/
+static TCB* sched_queue_steal()
+{
+	sched_queue* victim = NULL;
+	unsigned int most = 0;
+
+	/* The counts are read without locking, they are only a hint */
+	for (uint c = 0; c < cpu_cores(); c++) {
+		sched_queue* q = cctx[c].runq;
+		unsigned int qcount = __atomic_load_n(&q->count, __ATOMIC_RELAXED);
+		if (q != CURCORE.runq && qcount > most) {
+			most = qcount;
+			victim = q;
+		}
+	}
+
+	if (victim == NULL)
+		return NULL;
+
+	mcs_node qn;
+	mcs_lock_acquire(&victim->lock, &qn);
+	TCB* tcb = sched_queue_pop(victim);
+	mcs_lock_release(&victim->lock, &qn);
+	return tcb;
+}
+
 /*
 	Adjust the state of a thread to make it READY.
 	*** MUST BE CALLED WITH sched_spinlock HELD ***
@@ -277,11 +626,12 @@ static void sched_make_ready(TCB* tcb)
 {
 	assert(tcb->state == STOPPED || tcb->state == INIT);
 
-	/* Possibly remove from TIMEOUT_LIST */
+	/* Possibly remove from TIMER_WHEEL */
 	if (tcb->wakeup_time != NO_TIMEOUT) {
-		/* tcb is in TIMEOUT_LIST, fix it */
+		/* tcb is in TIMER_WHEEL, fix it */
 		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
 		rlist_remove(&tcb->sched_node);
+		TIMER_WHEEL.count--;
 		tcb->wakeup_time = NO_TIMEOUT;
 	}
 
@@ -294,44 +644,88 @@ static void sched_make_ready(TCB* tcb)
 }
 
 /*
-  Scan the \c TIMEOUT_LIST for threads whose timeout has expired, and
-  wake them up.
+  Find the earliest wakeup time in \c TIMER_WHEEL, scanning the slots in
+  tick order from tick \c now. Since a slot may hold threads of later
+  rotations, the scan stops at the first slot holding a thread of
+  its own tick.
   *** MUST BE CALLED WITH sched_spinlock HELD ***
 */
-static void sched_wakeup_expired_timeouts()
+static TimerDuration sched_next_timeout(TimerDuration now)
 {
-	/* Empty the timeout list up to the current time and wake up each thread */
-	TimerDuration curtime = bios_clock();
-
-	while (!is_rlist_empty(&TIMEOUT_LIST)) {
-		TCB* tcb = TIMEOUT_LIST.next->tcb;
-		if (tcb->wakeup_time > curtime)
+	TimerDuration next = NO_TIMEOUT;
+	if (TIMER_WHEEL.count == 0)
+		return next;
+
+	for (TimerDuration tick = now; tick < now + TIMER_WHEEL_SLOTS; tick++) {
+		rlnode* slot = &TIMER_WHEEL.slot[tick % TIMER_WHEEL_SLOTS];
+		int found = 0;
+		for (rlnode* n = slot->next; n != slot; n = n->next) {
+			if (n->tcb->wakeup_time < next)
+				next = n->tcb->wakeup_time;
+			found |= (n->tcb->wakeup_time / TIMER_WHEEL_TICK <= tick);
+		}
+		if (found)
 			break;
-		sched_make_ready(tcb);
 	}
+	return next;
 }
 
 /*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
+  Scan the slots of \c TIMER_WHEEL for the ticks that passed since the
+  last call, and wake up the threads whose timeout has expired.
   *** MUST BE CALLED WITH sched_spinlock HELD ***
 */
-static TCB* sched_queue_select(TCB* current)
-{	
-	int max_prior = 0;
-
-	for(int i=MAX_QUEUE_NUMBER-1; i>=0; i--){
-		int empty = is_rlist_empty(&SCHED[i]);
-
-		if(empty == 0){
-			max_prior = i;
-			break;
+static void sched_wakeup_expired_timeouts()
+{
+	TimerDuration curtime = bios_clock();
+	TimerDuration now = curtime / TIMER_WHEEL_TICK;
+
+	/* The current tick is scanned again next time, it may not be over yet */
+	TimerDuration tick = TIMER_WHEEL.tick;
+	TIMER_WHEEL.tick = now;
+	if (TIMER_WHEEL.count == 0)
+		return;
+
+	/* A full rotation visits every slot */
+	if (now - tick >= TIMER_WHEEL_SLOTS)
+		tick = now - TIMER_WHEEL_SLOTS + 1;
+
+	for (; tick <= now; tick++) {
+		rlnode* slot = &TIMER_WHEEL.slot[tick % TIMER_WHEEL_SLOTS];
+		for (rlnode* n = slot->next; n != slot;) {
+			TCB* tcb = n->tcb;
+			n = n->next; /* sched_make_ready() unlinks tcb */
+			if (tcb->wakeup_time <= curtime)
+				sched_make_ready(tcb);
 		}
 	}
-	/* Get the head of the SCHED list */
-	rlnode* sel = rlist_pop_front(&SCHED[max_prior]);
 
-	TCB* next_thread = sel->tcb; /* When the list is empty, this is NULL */
+	if (TIMER_WHEEL.next <= curtime)
+		TIMER_WHEEL.next = sched_next_timeout(now);
+}
+
+/*
+  Select the next thread to run on this core, removing it from the
+  run queue. If the run queue is empty, an idle core may steal a
+  thread from another core; else, the current thread continues if it
+  is READY, or the idle thread runs.
+  *** MUST BE CALLED WITHOUT sched_spinlock HELD ***
+*/
+static TCB* sched_queue_select(TCB* current)
+{
+	sched_queue* q = CURCORE.runq;
+
+	mcs_node qn;
+	mcs_lock_acquire(&q->lock, &qn);
+	if (++q->yield_calls > CALL_LIMIT)
+		boost(q);
+	TCB* next_thread = sched_queue_pop(q);
+	mcs_lock_release(&q->lock, &qn);
+
+	/* Steal work instead of going idle */
+	if (next_thread == NULL && scheduler_policy == SCHED_PERCORE_QUEUES
+		&& (current->state != READY || current->type == IDLE_THREAD))
+		next_thread = sched_queue_steal();
 
 	if (next_thread == NULL)
 		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
@@ -352,14 +746,15 @@ int wakeup(TCB* tcb)
 	int oldpre = preempt_off;
 
 	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(&sched_spinlock);
+	mcs_node qn;
+	mcs_lock_acquire(&sched_spinlock, &qn);
 
 	if (tcb->state == STOPPED || tcb->state == INIT) {
 		sched_make_ready(tcb);
 		ret = 1;
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	mcs_lock_release(&sched_spinlock, &qn);
 
 	/* Restore preemption state */
 	if (oldpre)
@@ -368,6 +763,102 @@ int wakeup(TCB* tcb)
 	return ret;
 }
 
+/*
+  Priority inheritance. A thread runs at the highest of its own priority
+  (base_priority) and the priorities of its donors. All the fields of 
+  donation are protected by sched_spinlock.
+ */
+
+/* The longest chain of donations that a change of priority is passed along. 
+   Only a deadlock makes a longer one (a cycle). */
+#define DONATION_CHAIN_MAX 32
+
+/*
+  Set the priority of a thread, moving it in its run queue.
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static void set_priority(TCB* tcb, int priority)
+{
+	/* A READY thread may be popped from its run queue at any time,
+	   so we must check again under the lock of the queue. */
+	sched_queue* q = __atomic_load_n(&tcb->runq, __ATOMIC_RELAXED);
+	if (q != NULL) {
+		mcs_node rn;
+		mcs_lock_acquire(&q->lock, &rn);
+		if (tcb->runq == q)
+			sched_queue_move(q, tcb, priority);
+		else
+			tcb->priority = priority;
+		mcs_lock_release(&q->lock, &rn);
+	} else
+		tcb->priority = priority;
+}
+
+/*
+  Recompute the priority of a thread from its own and its donors', and 
+  pass a change on along the chain of donees.
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static void update_priority(TCB* tcb)
+{
+	for (int i = 0; tcb != NULL && i < DONATION_CHAIN_MAX; i++) {
+		int priority = tcb->base_priority;
+		for (rlnode* n = tcb->donors.next; n != &tcb->donors; n = n->next)
+			if (n->tcb->priority > priority)
+				priority = n->tcb->priority;
+
+		if (priority == tcb->priority)
+			break;
+		set_priority(tcb, priority);
+		tcb = tcb->donee;
+	}
+}
+
+/*
+  Drop all the donations to and from an exiting thread.
+  *** MUST BE CALLED WITH sched_spinlock HELD ***
+*/
+static void drop_donations(TCB* tcb)
+{
+	while (!is_rlist_empty(&tcb->donors))
+		rlist_pop_front(&tcb->donors)->tcb->donee = NULL;
+	if (tcb->donee != NULL) {
+		TCB* donee = tcb->donee;
+		rlist_remove(&tcb->donor_node);
+		tcb->donee = NULL;
+		update_priority(donee);
+	}
+}
+
+void donate_priority(TCB* donor, TCB* donee)
+{
+	int preempt = preempt_off;
+	mcs_node qn;
+	mcs_lock_acquire(&sched_spinlock, &qn);
+
+	if (donee == donor || (donee != NULL && donee->state == EXITED))
+		donee = NULL;
+
+	TCB* old = donor->donee;
+	if (old != donee) {
+		if (old != NULL) {
+			rlist_remove(&donor->donor_node);
+			donor->donee = NULL;
+			update_priority(old);
+		}
+		if (donee != NULL) {
+			rlist_push_back(&donee->donors, &donor->donor_node);
+			donor->donee = donee;
+			update_priority(donee);
+		}
+	}
+
+	mcs_lock_release(&sched_spinlock, &qn);
+	if (preempt)
+		preempt_on;
+}
+
+
 /*
   Atomically put the current process to sleep, after unlocking mx.
  */
@@ -379,22 +870,27 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 
 	int preempt = preempt_off;
 	TCB* tcb = CURTHREAD;
-	Mutex_Lock(&sched_spinlock);
+	mcs_node qn;
+	mcs_lock_acquire(&sched_spinlock, &qn);
 
 	/* mark the thread as stopped or exited */
 	tcb->state = state;
+	if (state == EXITED)
+		drop_donations(tcb);
 
 	/* register the timeout (if any) for the sleeping thread */
 	if (state != EXITED)
 		sched_register_timeout(tcb, timeout);
 
-	/* Release mx */
+	/* Release the schduler spinlock before calling yield() !!! */
+	mcs_lock_release(&sched_spinlock, &qn);
+
+	/* Release mx. This may wake up a thread parked on mx, which needs
+	   sched_spinlock. It is safe to do this now, since our state is already
+	   set: if we are woken up before yield(), we are just made READY again. */
 	if (mx != NULL)
 		Mutex_Unlock(mx);
 
-	/* Release the schduler spinlock before calling yield() !!! */
-	Mutex_Unlock(&sched_spinlock);
-
 	/* call this to schedule someone else */
 	yield(cause);
 
@@ -405,28 +901,6 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 
 
 
-void boost(){
-
-	for(int i=0; i<MAX_QUEUE_NUMBER-1; i++){
-		int empty = is_rlist_empty(&SCHED[i]);
-
-		if(empty == 0){
-
-			while(!is_rlist_empty(&SCHED[i]) && i != MAX_QUEUE_NUMBER-1){
-
-				rlnode * current = rlist_pop_front(&SCHED[i]);
-				current->tcb->priority++;
-				rlist_append(&SCHED[i+1], current); 
-			}
-		}
-	}
-	yield_calls = 0;
-	//for each QUEUE
-	// refernece of tcb existing in this queue and increasing priority
-	// append lower priority queue to high priority queue
-	//end for
-}
-
 
 /* This function is the entry point to the scheduler's context switching */
 
@@ -438,30 +912,29 @@ void yield(enum SCHED_CAUSE cause)
 	/* We must stop preemption but save it! */
 	int preempt = preempt_off;
 
-	yield_calls++;
-
 	TCB* current = CURTHREAD; /* Make a local copy of current process, for speed */
 
-	Mutex_Lock(&sched_spinlock);
+	mcs_node qn;
+	mcs_lock_acquire(&sched_spinlock, &qn);
 
 	switch (cause)
 	{
 	case SCHED_IO:
-		if(current->priority < MAX_QUEUE_NUMBER-1){
-			current->priority++;
+		if(current->base_priority < MAX_QUEUE_NUMBER-1){
+			current->base_priority++;
 		}
 		break;
 	
 	case SCHED_QUANTUM:
-		if(current->priority > 0){
-			current->priority--;
+		if(current->base_priority > 0){
+			current->base_priority--;
 		}
 		break;
 	
 	case SCHED_MUTEX:
 		if(current->last_cause == SCHED_MUTEX){
-			if(current->priority > 0){
-			current->priority--;
+			if(current->base_priority > 0){
+			current->base_priority--;
 			}
 		}
 		break;		
@@ -469,10 +942,8 @@ void yield(enum SCHED_CAUSE cause)
 	default:
 		break;
 	}
+	update_priority(current);
 
-	if(yield_calls > CALL_LIMIT){
-		boost();
-	}
 	/* Update CURTHREAD state */
 	if (current->state == RUNNING)
 		current->state = READY;
@@ -485,6 +956,8 @@ void yield(enum SCHED_CAUSE cause)
 	/* Wake up threads whose sleep timeout has expired */
 	sched_wakeup_expired_timeouts();
 
+	mcs_lock_release(&sched_spinlock, &qn);
+
 	/* Get next */
 	TCB* next = sched_queue_select(current);
 	assert(next != NULL);
@@ -492,8 +965,6 @@ void yield(enum SCHED_CAUSE cause)
 	/* Save the current TCB for the gain phase */
 	CURCORE.previous_thread = current;
 
-	Mutex_Unlock(&sched_spinlock);
-
 	/* Switch contexts */
 	if (current != next) {
 		CURTHREAD = next;
@@ -519,7 +990,8 @@ void yield(enum SCHED_CAUSE cause)
 
 void gain(int preempt)
 {
-	Mutex_Lock(&sched_spinlock);
+	mcs_node qn;
+	mcs_lock_acquire(&sched_spinlock, &qn);
 
 	TCB* current = CURTHREAD;
 
@@ -528,6 +1000,16 @@ void gain(int preempt)
 	current->phase = CTX_DIRTY;
 	current->rts = current->its;
 
+	/* An idle core wakes up for the next timeout, to not delay it by a quantum */
+	TimerDuration alarm = current->rts;
+	if (current->type == IDLE_THREAD && TIMER_WHEEL.next != NO_TIMEOUT) {
+		TimerDuration curtime = bios_clock();
+		if (TIMER_WHEEL.next <= curtime)
+			alarm = 1;
+		else if (TIMER_WHEEL.next - curtime < alarm)
+			alarm = TIMER_WHEEL.next - curtime;
+	}
+
 	/* Take care of the previous thread */
 	TCB* prev = CURCORE.previous_thread;
 	if (current != prev) {
@@ -547,14 +1029,14 @@ void gain(int preempt)
 		}
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	mcs_lock_release(&sched_spinlock, &qn);
 
 	/* Reset preemption as needed */
 	if (preempt)
 		preempt_on;
 
 	/* Set a 1-quantum alarm */
-	bios_set_timer(current->rts);
+	bios_set_timer(alarm);
 }
 
 static void idle_thread()
@@ -574,14 +1056,49 @@ static void idle_thread()
 }
 
 /*
-  Initialize the scheduler queue
+  Initialize the scheduler queues
  */
 void initialize_scheduler()
 {
-	for(int i=0; i<MAX_QUEUE_NUMBER; i++){
-	rlnode_init(&SCHED[i], NULL);
+	const char* policy = getenv("TINYOS_SCHED");
+	scheduler_policy = (policy != NULL && strcmp(policy, "percore") == 0)
+		? SCHED_PERCORE_QUEUES : SCHED_GLOBAL_QUEUE;
+
+	/* Allocate the core control blocks, each on its own cache lines */
+	size_t ccb_size = cpu_cores() * sizeof(CCB);
+	cctx = aligned_alloc(CCB_ALIGN, ccb_size);
+	CHECK_CONDITION(cctx != NULL);
+	memset(cctx, 0, ccb_size);
+
+	sched_queue_init(&GLOBAL_RUNQ);
+	for (uint c = 0; c < cpu_cores(); c++) {
+		sched_queue_init(&cctx[c].local_runq);
+		cctx[c].runq = (scheduler_policy == SCHED_PERCORE_QUEUES)
+			? &cctx[c].local_runq : &GLOBAL_RUNQ;
+	}
+
+	for (int i = 0; i < TIMER_WHEEL_SLOTS; i++)
+		rlnode_init(&TIMER_WHEEL.slot[i], NULL);
+	TIMER_WHEEL.tick = bios_clock() / TIMER_WHEEL_TICK;
+	TIMER_WHEEL.count = 0;
+	TIMER_WHEEL.next = NO_TIMEOUT;
+}
+
+void finalize_scheduler()
+{
+	for (uint c = 0; c < cpu_cores(); c++) {
+		thread_cache* tc = &cctx[c].thread_cache;
+		free_thread_list(tc->free);
+		tc->free = NULL;
+		tc->size = 0;
 	}
-	rlnode_init(&TIMEOUT_LIST, NULL);
+
+	free_thread_list(THREAD_DEPOT.free);
+	THREAD_DEPOT.free = NULL;
+	THREAD_DEPOT.size = 0;
+
+	free(cctx);
+	cctx = NULL;
 }
 
 void run_scheduler()
@@ -599,6 +1116,10 @@ void run_scheduler()
 	curcore->idle_thread.phase = CTX_DIRTY;
 	curcore->idle_thread.wakeup_time = NO_TIMEOUT;
 	rlnode_init(&curcore->idle_thread.sched_node, &curcore->idle_thread);
+	curcore->idle_thread.base_priority = curcore->idle_thread.priority;
+	curcore->idle_thread.donee = NULL;
+	rlnode_init(&curcore->idle_thread.donor_node, &curcore->idle_thread);
+	rlnode_init(&curcore->idle_thread.donors, NULL);
 
 	curcore->idle_thread.its = QUANTUM;
 	curcore->idle_thread.rts = QUANTUM;
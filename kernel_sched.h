@@ -84,7 +84,7 @@ typedef enum {
 enum SCHED_CAUSE {
 	SCHED_QUANTUM, /**< @brief The quantum has expired */
 	SCHED_IO, /**< @brief The thread is waiting for I/O */
-	SCHED_MUTEX, /**< @brief @c Mutex_Lock yielded on contention */
+	SCHED_MUTEX, /**< @brief @c Mutex_Lock slept on contention */
 	SCHED_PIPE, /**< @brief Sleep at a pipe or socket */
 	SCHED_POLL, /**< @brief The thread is polling a device */
 	SCHED_IDLE, /**< @brief The idle thread called yield */
@@ -103,6 +103,7 @@ typedef struct thread_control_block {
   int priority;   /**< @brief This is the execution priority level of this TCB */
   
 	cpu_context_t context; /**< @brief The thread context */
+	size_t stack_size; /**< @brief The size of the thread stack */
 
 #ifndef NVALGRIND
 	unsigned valgrind_stack_id; /**< @brief Valgrind helper for stacks. 
@@ -130,6 +131,15 @@ typedef struct thread_control_block {
 	enum SCHED_CAUSE curr_cause; /**< @brief The endcause for the current time-slice */
 	enum SCHED_CAUSE last_cause; /**< @brief The endcause for the last time-slice */
 
+	int base_priority; /**< @brief The priority given by the scheduling policy, before 
+	  donations. @c priority is the highest of this and the priorities of the donors.
+	  @see donate_priority */
+	struct thread_control_block* donee; /**< @brief The thread this thread donates its 
+	  priority to, or NULL */
+	rlnode donor_node; /**< @brief Node in the @c donors list of the donee */
+	rlnode donors; /**< @brief List of the threads that donate their priority to this one */
+	struct sched_queue* runq; /**< @brief The run queue that holds this thread, or NULL */
+
 } TCB;
 
 /**
@@ -156,9 +166,26 @@ typedef struct process_thread_control_block{
   rlnode ptcb_list_node; /**< @brief The rlnode variale connecting this node to the list */
 } PTCB;
 
+/** @brief A per-core cache of free thread blocks.
+
+  A thread block is the memory of a TCB together with its stack. Blocks
+  released by exiting threads are kept in the cache of the releasing core,
+  and reused by the next threads spawned on that core. 
+
+  @see get_thread_pool_stats
+ */
+typedef struct thread_cache {
+	void* free; /**< @brief List of free blocks, linked through their first word */
+	unsigned int size; /**< @brief Number of blocks in @c free */
+	unsigned long hits; /**< @brief Allocations served by the pool */
+	unsigned long misses; /**< @brief Allocations served by the host allocator */
+} thread_cache;
+
 /** @brief Thread stack size.
 
-  The default thread stack size in TinyOS is 128 kbytes.
+  The default thread stack size in TinyOS is 128 kbytes. Stacks are
+  reserved in virtual memory, and only the pages that a thread touches
+  take up memory. A stack overflow hits a guard page and faults.
  */
 #define THREAD_STACK_SIZE (128 * 1024)
 
@@ -168,6 +195,80 @@ typedef struct process_thread_control_block{
  *
  ************************/
 
+/** @brief A node of the queue of an MCS lock.
+
+  Each core that acquires an @c mcs_lock supplies a node, usually a local
+  variable of the function that holds the lock. The node must stay valid
+  until the matching call to @c mcs_lock_release.
+ */
+typedef struct mcs_node {
+	struct mcs_node* next; /**< @brief The next waiter in the queue */
+	int locked; /**< @brief Set while the owner of the node waits */
+} mcs_node;
+
+/** @brief A queue spinlock for the scheduler.
+
+  This is the lock of Mellor-Crummey and Scott. The waiting cores form a
+  FIFO queue, and each one spins on the @c locked flag of its own node.
+  Thus, the lock is granted in arrival order, and a handoff touches only
+  the cache line of the next waiter. In contrast, all the waiters of a
+  @c Mutex spin on the same byte, and any of them may win the lock.
+
+  An MCS lock is a pure spinlock: it must be acquired and released on the
+  same core, with preemption off.
+ */
+typedef struct mcs_lock {
+	mcs_node* tail; /**< @brief The last node in the queue, or NULL if the lock is free */
+} mcs_lock;
+
+/** @brief Initializer for @c mcs_lock */
+#define MCS_LOCK_INIT { NULL }
+
+/** @brief Acquire an MCS lock, waiting on @c node. */
+void mcs_lock_acquire(mcs_lock* lock, mcs_node* node);
+
+/** @brief Release an MCS lock that was acquired with @c node. */
+void mcs_lock_release(mcs_lock* lock, mcs_node* node);
+
+/** @brief Number of priority levels of the multilevel feedback queue.
+
+  Level @c MAX_QUEUE_NUMBER-1 is the highest priority.
+ */
+#define MAX_QUEUE_NUMBER THREAD_PRIORITY_LEVELS
+
+/** @brief A multilevel run queue.
+
+  A run queue holds the @c READY threads, in one list per priority level.
+  Depending on the scheduling policy, there is either a single run queue
+  shared by all cores, or one run queue per core.
+
+  @see sched_policy
+ */
+typedef struct sched_queue {
+	mcs_lock lock; /**< @brief Spinlock protecting the queue */
+	rlnode level[MAX_QUEUE_NUMBER]; /**< @brief One list of threads per priority */
+	unsigned int occupied; /**< @brief Bitmap of the non-empty levels; bit @c i is set iff @c level[i] is not empty */
+	unsigned int count; /**< @brief Number of threads in the queue */
+	int yield_calls; /**< @brief Selections since the last priority boost */
+} sched_queue;
+
+/** @brief Run-queue organization of the scheduler.
+
+  The policy is chosen at boot time, from the @c TINYOS_SCHED environment
+  variable: a value of @c percore selects @c SCHED_PERCORE_QUEUES, anything
+  else (or no value) selects @c SCHED_GLOBAL_QUEUE.
+ */
+typedef enum {
+	SCHED_GLOBAL_QUEUE, /**< @brief All cores share a single run queue */
+	SCHED_PERCORE_QUEUES /**< @brief Each core has its own run queue, idle cores steal work */
+} sched_policy;
+
+/** @brief The run-queue policy the kernel was booted with */
+extern sched_policy scheduler_policy;
+
+/** @brief The alignment of core control blocks, so that no two share a cache line */
+#define CCB_ALIGN 64
+
 /** @brief Core control block.
 
   Per-core info in memory (basically scheduler-related). 
@@ -180,10 +281,14 @@ typedef struct core_control_block {
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
 	sig_atomic_t preemption; /**< @brief Marks preemption, used by the locking code */
 
-} CCB;
+	sched_queue* runq; /**< @brief The run queue this core schedules from */
+	sched_queue local_runq; /**< @brief This core's own run queue, under @c SCHED_PERCORE_QUEUES */
+	thread_cache thread_cache; /**< @brief This core's cache of free thread blocks */
+
+} __attribute__((aligned(CCB_ALIGN))) CCB;
 
-/** @brief the array of Core Control Blocks (CCB) for the kernel */
-extern CCB cctx[MAX_CORES];
+/** @brief the array of Core Control Blocks (CCB) for the kernel, one per core */
+extern CCB* cctx;
 
 /** @brief The current core's CCB */
 #define CURCORE (cctx[cpu_core_id])
@@ -221,9 +326,20 @@ extern CCB cctx[MAX_CORES];
                 otherwise ignores it
 
     @param func The function to execute in the new thread.
+    @param attr The stack size and initial priority of the new thread, or
+                NULL for the defaults. It must be valid.
     @returns  A pointer to the TCB of the new thread, in the @c INIT state.
+    @see thread_attr_valid
 */
-TCB* spawn_thread(PCB* pcb, PTCB* ptcb, void (*func)());
+TCB* spawn_thread(PCB* pcb, PTCB* ptcb, void (*func)(), const thread_attr* attr);
+
+/**
+  @brief Check the attributes for a new thread.
+
+  @param attr the attributes to check, or NULL for the defaults
+  @returns 1 if @c attr can be passed to @c spawn_thread, else 0
+ */
+int thread_attr_valid(const thread_attr* attr);
 
 /**
   @brief Wakeup a blocked thread.
@@ -269,6 +385,28 @@ int wakeup(TCB* tcb);
    */
 void sleep_releasing(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause, TimerDuration timeout);
 
+/**
+  @brief Make a thread donate its priority to another (priority inheritance).
+
+  This is called for a thread that sleeps on a mutex, so that the owner of
+  the mutex is not starved by threads of lower priority than the waiter, 
+  while it holds the mutex. A thread donates to at most one thread at a 
+  time, so this replaces any previous donation of @c donor; with @c donee
+  equal to NULL, the donation is withdrawn.
+
+  The priority of a thread is the highest of its own (@c base_priority) and 
+  those of its donors. Donation is transitive: a change in the priority of 
+  a thread passes on to its donee, and so on. A thread in a run queue is 
+  moved to its new priority level.
+
+  The caller must guarantee that @c donee has not exited. The donations to 
+  a thread that exits are dropped.
+
+  @param donor the thread that donates
+  @param donee the thread that receives the donation, or NULL
+ */
+void donate_priority(TCB* donor, TCB* donee);
+
 /**
   @brief Give up the CPU.
 
@@ -294,6 +432,25 @@ void run_scheduler(void);
  */
 void initialize_scheduler(void);
 
+/**
+  @brief Finalize the scheduler.
+
+  This function is called by core 0 at kernel shutdown, after all cores 
+  have left the scheduler. It returns the pooled thread blocks to the host.
+ */
+void finalize_scheduler(void);
+
+/**
+  @brief Get the statistics of the thread block pool.
+
+  The values are summed over all cores. While threads are being created
+  on other cores, they are approximate.
+
+  @param stats the object to fill
+  @see GetThreadPoolStats
+ */
+void get_thread_pool_stats(thread_pool_stats* stats);
+
 /**
   @brief Quantum (in microseconds) 
 
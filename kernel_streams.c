@@ -11,6 +11,20 @@
 FCB FT[MAX_FILES];
 rlnode FCB_freelist;
 
+/* 
+  The file table lock protects the FCB free list, the FCB reference counts 
+  and the fid tables of all processes. It is never held while calling 
+  the stream methods, which may block.
+
+  A reserved FCB sits in the fid table with a zero reference count, while 
+  its stream is set up, and is ignored by everyone but its creator. It is 
+  published by FCB_publish, under the lock, once its stream is complete.
+ */
+static Mutex file_table_lock = MUTEX_INIT;
+
+/* The FCB of a fid, unless it is free or not published yet */
+#define PUBLISHED(fcb) ((fcb)!=NULL && (fcb)->refcount>0)
+
 
 void initialize_files()
 {
@@ -24,18 +38,22 @@ void initialize_files()
 }
 
 
-FCB* acquire_FCB()
+/* Must be called with file_table_lock held */
+static FCB* acquire_FCB()
 {
   if(! is_rlist_empty(& FCB_freelist)) {
     FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
     fcb->refcount = 0;
+    fcb->streamobj = NULL;
+    fcb->streamfunc = NULL;
     return fcb;
   }
   else
     return NULL;
 }
 
-void release_FCB(FCB* fcb)
+/* Must be called with file_table_lock held */
+static void release_FCB(FCB* fcb)
 {
   rlist_push_back(& FCB_freelist, & fcb->freelist_node);
 }
@@ -44,20 +62,57 @@ void release_FCB(FCB* fcb)
 void FCB_incref(FCB* fcb)
 {
   assert(fcb);
+  Mutex_Lock(&file_table_lock);
   fcb->refcount++;
+  Mutex_Unlock(&file_table_lock);
 }
 
 int FCB_decref(FCB* fcb)
 {
   assert(fcb);
+  Mutex_Lock(&file_table_lock);
   fcb->refcount --;
   if(fcb->refcount==0) {
-    int retval = fcb->streamfunc->Close(fcb->streamobj);
+    /* The FCB can be reused as soon as it is released, so keep its stream */
+    void* sobj = fcb->streamobj;
+    file_ops* sfunc = fcb->streamfunc;
     release_FCB(fcb);
-    return retval;
+    Mutex_Unlock(&file_table_lock);
+
+    return sfunc->Close(sobj);
   }
-  else
-    return 0;
+  Mutex_Unlock(&file_table_lock);
+  return 0;
+}
+
+
+void FCB_copy_table(PCB* from, PCB* to)
+{
+  Mutex_Lock(&file_table_lock);
+  for(int i=0; i<MAX_FILEID; i++) {
+    to->FIDT[i] = PUBLISHED(from->FIDT[i]) ? from->FIDT[i] : NULL;
+    if(to->FIDT[i])
+      to->FIDT[i]->refcount++;
+  }
+  Mutex_Unlock(&file_table_lock);
+}
+
+
+void FCB_close_table(PCB* pcb)
+{
+  FCB* fcbs[MAX_FILEID];
+
+  Mutex_Lock(&file_table_lock);
+  for(int i=0; i<MAX_FILEID; i++) {
+    assert(pcb->FIDT[i]==NULL || PUBLISHED(pcb->FIDT[i]));
+    fcbs[i] = pcb->FIDT[i];
+    pcb->FIDT[i] = NULL;
+  }
+  Mutex_Unlock(&file_table_lock);
+
+  for(int i=0; i<MAX_FILEID; i++)
+    if(fcbs[i] != NULL)
+      FCB_decref(fcbs[i]);
 }
 
 
@@ -68,6 +123,8 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
     size_t f=0;
     uint i;
 
+    Mutex_Lock(&file_table_lock);
+
     /* Find distinct fids */
     for(i=0; i<num; i++) {
 	while(f<MAX_FILEID && cur->FIDT[f]!=NULL)
@@ -75,7 +132,7 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	if(f==MAX_FILEID) break;
 	fid[i] = f; f++;
     }
-    if(i<num) return 0;
+    if(i<num) goto fail;
     /* Allocate FCBs */
     for(i=0;i<num;i++)
 	if((fcb[i] = acquire_FCB()) == NULL)
@@ -86,26 +143,44 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	    release_FCB(fcb[i-1]);
 	    i--;
 	}
-	return 0;
+	goto fail;
     }
-    /* Found all */
-    for(i=0;i<num;i++) {
+    /* Found all; they are hidden until published */
+    for(i=0;i<num;i++)
 	cur->FIDT[fid[i]]=fcb[i];
-	FCB_incref(fcb[i]);
-    }
+    Mutex_Unlock(&file_table_lock);
     return 1;
+
+fail:
+    Mutex_Unlock(&file_table_lock);
+    return 0;
 }
 
 
 
+void FCB_publish(size_t num, Fid_t *fid, FCB** fcb)
+{
+    Mutex_Lock(&file_table_lock);
+    for(size_t i=0; i<num ; i++) {
+	assert(CURPROC->FIDT[fid[i]]==fcb[i] && fcb[i]->refcount==0);
+	assert(fcb[i]->streamfunc != NULL);
+	fcb[i]->refcount = 1;
+    }
+    Mutex_Unlock(&file_table_lock);
+}
+
+
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
+    Mutex_Lock(&file_table_lock);
     for(size_t i=0; i<num ; i++) {
-	assert(cur->FIDT[fid[i]]==fcb[i]);
+	/* Not published, so no one else holds a reference */
+	assert(cur->FIDT[fid[i]]==fcb[i] && fcb[i]->refcount==0);
 	cur->FIDT[fid[i]] = NULL;
 	release_FCB(fcb[i]);
     }
+    Mutex_Unlock(&file_table_lock);
 }
 
 
@@ -124,7 +199,15 @@ FCB* get_fcb(Fid_t fid)
 {
   if(fid < 0 || fid >= MAX_FILEID) return NULL;
 
-  return CURPROC->FIDT[fid];
+  Mutex_Lock(&file_table_lock);
+  FCB* fcb = CURPROC->FIDT[fid];
+  if(PUBLISHED(fcb)) 
+    fcb->refcount++;
+  else
+    fcb = NULL;
+  Mutex_Unlock(&file_table_lock);
+
+  return fcb;
 }
 
 
@@ -135,17 +218,15 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
   void* sobj;
 
   
-  /* Get the fields from the stream */
+  /* Get the fields from the stream. The reference we get makes sure 
+     that the stream will not be closed (by another thread) while we 
+     are using it! */
   FCB* fcb = get_fcb(fd);
 
   if(fcb) {
     sobj = fcb->streamobj;
     devread = fcb->streamfunc->Read;
 
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
     if(devread)
       retcode = devread(sobj, buf, size);
 
@@ -167,7 +248,7 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
   void* sobj = NULL;
 
   
-  /* Get the fields from the stream */
+  /* Get the fields from the stream (see sys_Read) */
   FCB* fcb = get_fcb(fd);
 
   if(fcb) {
@@ -175,11 +256,6 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
     sobj = fcb->streamobj;
     devwrite = fcb->streamfunc->Write;
 
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
-
     if(devwrite)
       retcode = devwrite(sobj, buf, size);
 
@@ -197,10 +273,17 @@ int sys_Close(int fd)
 {
   int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
 
-  FCB* fcb = get_fcb(fd);
+  if(retcode == -1) return -1;
 
-  if(fcb) {
+  Mutex_Lock(&file_table_lock);
+  FCB* fcb = CURPROC->FIDT[fd];
+  if(PUBLISHED(fcb))
     CURPROC->FIDT[fd] = NULL;
+  else
+    fcb = NULL;   /* A reserved fid is still being opened, leave it alone */
+  Mutex_Unlock(&file_table_lock);
+
+  if(fcb) {
     retcode = FCB_decref(fcb);    
   }
 
@@ -221,18 +304,22 @@ int sys_Dup2(int oldfd, int newfd)
   if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
     return -1;
 
-  FCB* old = get_fcb(oldfd);
-  FCB* new = get_fcb(newfd);
+  Mutex_Lock(&file_table_lock);
+  FCB* old = CURPROC->FIDT[oldfd];
+  FCB* new = CURPROC->FIDT[newfd];
 
-  if(old==NULL) {
+  if(! PUBLISHED(old) || (new!=NULL && ! PUBLISHED(new))) {
     retcode = -1;
   }
   else if(old!=new) {
-    if(new)
-      FCB_decref(new);
-    FCB_incref(old);
+    old->refcount++;
     CURPROC->FIDT[newfd] = old;
   }
+  Mutex_Unlock(&file_table_lock);
+
+  /* Close the previous stream of newfd, outside the lock */
+  if(retcode==0 && new!=NULL && old!=new)
+    FCB_decref(new);
 
   return retcode;
 }
@@ -261,6 +348,7 @@ Fid_t open_stream(Device_type major, unsigned int minor)
       FCB_unreserve(1, &fid, &fcb);
       goto finerr;
   }
+  FCB_publish(1, &fid, &fcb);
   
   goto finok;
 finerr:
@@ -20,8 +20,13 @@
 
 	The streams of each process are held in the file table of the
 	PCB of the process. The system calls generally use the API
-	of this file to access FCBs: @ref get_fcb, @ref FCB_reserve
-	and @ref FCB_unreserve.
+	of this file to access FCBs: @ref get_fcb, @ref FCB_reserve,
+	@ref FCB_publish and @ref FCB_unreserve.
+
+	The file tables of all processes, the FCB reference counts and
+	the pool of free FCBs are protected by a file table lock, which
+	is internal to this API. The lock is not held while the stream
+	methods are called, since they may block.
 
 	Streams are connected to devices by virtue of a @c file_operations
 	object, which provides pointers to device-specific implementations
@@ -89,6 +94,11 @@ int FCB_decref(FCB* fcb);
    If these resources are not needed, the operation can be
    reversed by calling @ref FCB_unreserve.
 
+   The reserved fids are not visible to the process (they look 
+   closed to every other call) until the caller sets the 
+   @c streamobj and @c streamfunc fields of the FCBs, and calls
+   @ref FCB_publish.
+
    @param num the number of resources to reserve.
    @param fid array of size at least `num` of `Fid_t`.
    @param fcb array of size at least `num` of `FCB*`.
@@ -97,6 +107,19 @@ int FCB_decref(FCB* fcb);
 int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb);
 
 
+/** @brief Publish a number of reserved FCBs.
+
+   After this call, the fids reserved by @ref FCB_reserve refer to 
+   their FCBs, whose streams must be set up by now. Each FCB gets 
+   one reference, held by its fid.
+
+   @param num the number of resources to publish.
+   @param fid array of size at least `num` of `Fid_t`.
+   @param fcb array of size at least `num` of `FCB*`.
+*/
+void FCB_publish(size_t num, Fid_t *fid, FCB** fcb);
+
+
 /** @brief Release a number of FCBs and corresponding fids.
 
    Given an array of fids of size @ num, this function will 
@@ -108,7 +131,8 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb);
    No I/O operation is performed by this function.
 
    This function does not check its arguments for correctness.
-   Use only with arrays filled by a call to @ref FCB_reserve.
+   Use only with arrays filled by a call to @ref FCB_reserve,
+   before they are published.
 
    @param num the number of resources to unreserve.
    @param fid array of size at least `num` of `Fid_t`.
@@ -120,6 +144,9 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 /** @brief Translate an fid to an FCB.
 
 	This routine will return NULL if the fid is not legal.
+	Else, the reference count of the FCB is increased, so that the
+	stream is not closed (by another thread) while it is used. The
+	caller must release the reference by calling @ref FCB_decref.
 
 	@param fid the file ID to translate to a pointer to FCB
 	@returns a pointer to the corresponding FCB, or NULL.
@@ -127,11 +154,54 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 FCB* get_fcb(Fid_t fid);
 
 
-#define PIPE_BUFFER_SIZE 131072	//size of buffer
+/** @brief Copy the fid table of a process to another.
+
+	This is used when a process is created, to inherit the streams
+	of its parent. The reference count of each copied FCB is increased.
+
+	@param from the process whose fid table is copied
+	@param to the process whose fid table is set
+ */
+void FCB_copy_table(PCB* from, PCB* to);
+
+
+/** @brief Close all fids of a process.
+
+	This is used when a process exits. The reference count of each 
+	FCB in the fid table is decreased, possibly closing its stream.
+
+	@param pcb the process whose fids are closed
+ */
+void FCB_close_table(PCB* pcb);
+
 
+#define PIPE_BUFFER_MIN 4096	//initial size of buffer
+#define PIPE_BUFFER_SIZE 131072	//default limit of buffer size
+#define PIPE_BUFFER_MAX (1<<20)	//largest limit, see PipeSetCapacity()
+#define PIPE_FAST_SPINS 100	//spins waiting for lock-free transfers, before yielding
 
+
+/*
+	The pipe buffer is a ring, allocated at the first write. It grows as 
+	needed, doubling in size, up to the limit of the pipe. When the pipe is 
+	drained, a buffer much larger than the data it has held since the 
+	previous drain is released, and the next write allocates one of a fitting 
+	size. All sizes are powers of 2.
+	The positions are free-running counters, whose difference is the number
+	of bytes in the pipe, and which are reduced modulo the size to index 
+	the buffer.
+
+	Waiters are woken up only by the transitions that let them proceed: 
+	a reader when the pipe becomes non-empty, a writer when the free space 
+	rises to the low watermark (a quarter of the limit). One waiter is 
+	woken at a time; if it leaves data (or space) behind, it wakes the next.
+
+	When each end is used by a single thread, transfers that need not block
+	or grow the buffer skip the lock (see kernel_pipe.c).
+ */
 typedef struct pipe_control_block { 
 	
+	Mutex lock;			/* protects the pipe, except in lock-free transfers */
 	FCB *reader, *writer;
 
 	CondVar has_space; 
@@ -139,9 +209,19 @@ typedef struct pipe_control_block {
 
 	unsigned int w_position, r_position;
 
-	unsigned int capacity;
+	char* BUFFER;			/* the ring buffer, or NULL */
+	unsigned int size;		/* the size of BUFFER, or 0 */
+	unsigned int limit;		/* the largest size of BUFFER */
+	unsigned int peak;		/* the most bytes held since the last drain */
+
+	unsigned int readers_waiting;	/* threads blocked on has_data */
+	unsigned int writers_waiting;	/* threads blocked on has_space */
+
+	int fast_reader, fast_writer;	/* a lock-free transfer is in progress at this end */
+	unsigned int slow;		/* locked transfers in progress, which exclude lock-free ones */
 
-	char BUFFER[PIPE_BUFFER_SIZE];
+	int read_pinned;		/* a Splice is writing out the data at r_position, unlocked */
+	int write_pinned;		/* a Splice is reading into the space at w_position, unlocked */
 
 } pipe_cb;
 
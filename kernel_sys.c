@@ -21,9 +21,16 @@ kernel_lock();\
 kernel_unlock();\
 
 
-/* with return */
+/* with return, fine-grained locking */
 #define SYSCALL(NAME, RET, SIG, ARGS)\
 RET NAME SIG \
+{\
+	return sys_##NAME ARGS;\
+}\
+
+/* with return, holding the kernel lock */
+#define SYSCALL_BKL(NAME, RET, SIG, ARGS)\
+RET NAME SIG \
 {\
 	RET __ret;\
 	PRE_CALL\
@@ -32,13 +39,11 @@ RET NAME SIG \
 	return __ret;\
 }\
 
-/* without return */
+/* without return, fine-grained locking */
 #define SYSCALLV(NAME, SIG, ARGS)\
 void NAME SIG \
 {\
-	PRE_CALL\
 	sys_##NAME ARGS;\
-	POST_CALL\
 }\
 
 
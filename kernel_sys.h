@@ -4,13 +4,24 @@
 #include "bios.h"
 #include "tinyos.h"
 
+/*
+	The list of system calls.
+
+	Calls declared by SYSCALL and SYSCALLV do their own locking, with the locks
+	of the subsystems they use (the process table, the file table, each pipe
+	and each device). Calls declared by SYSCALL_BKL are executed holding the
+	kernel lock (see kernel_lock()), and may use kernel_wait().
+ */
 #define SYSCALLS \
 SYSCALL(Exec, int, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL(ExecEx, int, (Task task, int argl, void* args, const thread_attr* attr), (task, argl, args, attr))\
 SYSCALLV(Exit, (int exitval), (exitval))\
 SYSCALL(GetPid, int, (void), ())\
 SYSCALL(GetPPid, int, (void), ())\
+SYSCALL(GetTime, unsigned long, (void), ())\
 SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
 SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL(CreateThreadEx, Tid_t, (Task task, int argl, void* args, const thread_attr* attr), (task, argl, args, attr))\
 SYSCALL(ThreadSelf, Tid_t, (void), ())\
 SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
 SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
@@ -23,18 +34,24 @@ SYSCALL(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))
 SYSCALL(Close,int,(Fid_t fd),(fd))\
 SYSCALL(Dup2,int, (Fid_t oldfd, Fid_t newfd), (oldfd,newfd))\
 SYSCALL(Pipe, int, (pipe_t* pipe), (pipe))\
-SYSCALL(Socket, Fid_t, (port_t port), (port))\
-SYSCALL(Listen, int, (Fid_t sock), (sock))\
-SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
-SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
-SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
-SYSCALL(OpenInfo, Fid_t, (), ())\
+SYSCALL(PipeSetCapacity, int, (Fid_t fid, unsigned int size), (fid, size))\
+SYSCALL(Splice, int, (Fid_t in, Fid_t out, unsigned int size), (in, out, size))\
+SYSCALL(Tee, int, (Fid_t in, Fid_t out, unsigned int size), (in, out, size))\
+SYSCALL(GetThreadPoolStats, int, (thread_pool_stats* stats), (stats))\
+SYSCALL_BKL(Socket, Fid_t, (port_t port), (port))\
+SYSCALL_BKL(Listen, int, (Fid_t sock), (sock))\
+SYSCALL_BKL(Accept, Fid_t, (Fid_t lsock), (lsock))\
+SYSCALL_BKL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
+SYSCALL_BKL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
+SYSCALL_BKL(OpenInfo, Fid_t, (), ())\
 
 
 
 #define SYSCALL(NAME, RET, SIG, ARGS)\
 RET sys_ ## NAME SIG;
 
+#define SYSCALL_BKL(NAME, RET, SIG, ARGS) SYSCALL(NAME, RET, SIG, ARGS)
+
 /* without return */
 #define SYSCALLV(NAME, SIG, ARGS)\
 void sys_ ## NAME SIG;
@@ -42,6 +59,7 @@ void sys_ ## NAME SIG;
 SYSCALLS
 
 #undef SYSCALL
+#undef SYSCALL_BKL
 #undef SYSCALLV
 
 #endif
\ No newline at end of file
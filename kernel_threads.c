@@ -54,6 +54,17 @@ void start_common_thread()
   */
 Tid_t sys_CreateThread(Task task, int argl, void* args)
 {
+  return sys_CreateThreadEx(task, argl, args, NULL);
+}
+
+/** 
+  @brief Create a new thread in the current process, with the given attributes.
+  */
+Tid_t sys_CreateThreadEx(Task task, int argl, void* args, const thread_attr* attr)
+{
+  if(! thread_attr_valid(attr))
+    return NOTHREAD;
+
   //The thread will be created in the current calling-running process
   PCB* curproc = CURPROC;
 
@@ -66,6 +77,8 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
   ptcb->argl = argl;
   ptcb->args = args;
 
+  Mutex_Lock(&proc_table_lock);
+
   //Initialize the PTCB node to connect it with itself and insert it 
   //in the list of the PTCBs of the process
   rlist_push_back(& curproc->ptcb_list, rlnode_init(&ptcb->ptcb_list_node, ptcb));
@@ -76,14 +89,16 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
 
   if(task!=NULL){
     //Create a TCB and initialize it with according parameters and show it the way it will be started and exited
-    TCB* new_thread = spawn_thread(curproc, ptcb, start_common_thread);
+    TCB* new_thread = spawn_thread(curproc, ptcb, start_common_thread, attr);
     //Make the thread READY
     wakeup(new_thread);
     ASSERT(curproc->thread_count == rlist_len(& curproc->ptcb_list));
+    Mutex_Unlock(&proc_table_lock);
     return (Tid_t)ptcb;
   }
 
   //Usually we dont get here
+  Mutex_Unlock(&proc_table_lock);
   return -1;
 }
 
@@ -106,14 +121,17 @@ int sys_ThreadJoin(Tid_t tid, int* exitval){
   //What's the PTCB corresponding to the Tid_t given as argument
   PTCB* ptcb = (PTCB*)tid;
 
+  int retval = -1;
+  Mutex_Lock(&proc_table_lock);
+
   //Check if the PTCB exists in the PTCB list of the current process
   if(rlist_find(& CURPROC->ptcb_list,ptcb,NULL) == NULL){
-    return -1;
+    goto finish;
   }
 
   //If the Tid_t is invalid or if the thread tries to join itself return error
   if(tid==NOTHREAD || tid == tidCur){
-    return -1;
+    goto finish;
   }
 
   //The kernel wait will use a reference to the PTCB so we increase the counter
@@ -122,7 +140,7 @@ int sys_ThreadJoin(Tid_t tid, int* exitval){
   //While the joined thread isn't exited or detached all the joiners are waiting through kernel_wait function
   //the Cond_Var to be in exited state
   while(ptcb->exited==0 && ptcb->detached==0){
-    kernel_wait(&ptcb->exit_cv, SCHED_USER);
+    kernel_wait_mutex(&ptcb->exit_cv, &proc_table_lock, SCHED_USER);
   }
 
   //The exitval might be NULL we don't want to do a NULL assignment
@@ -132,14 +150,18 @@ int sys_ThreadJoin(Tid_t tid, int* exitval){
 
   //If the joined thread had became detached after joiners are attached to it an error occurs 
   if(ptcb->detached==1){
-    return -1;
+    goto finish;
   }
 
   ptcb->refcount--;
 
 
   //Joining succeed
-  return 0;
+  retval = 0;
+
+finish:
+  Mutex_Unlock(&proc_table_lock);
+  return retval;
 }
 
 
@@ -155,24 +177,30 @@ int sys_ThreadDetach(Tid_t tid)
   //What's the PTCB corresponding to the Tid_t given as argument
   PTCB* ptcb = (PTCB*)tid;
 
+  int retval = -1;
+  Mutex_Lock(&proc_table_lock);
+
   //Check if the PTCB exists in the PTCB list of the current process
   if(rlist_find(& CURPROC->ptcb_list,ptcb,NULL) == NULL){
     //If it does not exist in the list or the find function returns NULL then error returns
-    return -1;
+    goto finish;
   }
   
   //Check if the tid given is ZERO or if the corresponding PTCB is exited
-  if(tid==NOTHREAD) return -1;
+  if(tid==NOTHREAD) goto finish;
   
-  if(ptcb->exited == 1) return -1;
+  if(ptcb->exited == 1) goto finish;
 
   //If everything is normal detach the thread which was given as argument
   ptcb->detached=1;
   kernel_broadcast(& ptcb->exit_cv);
   //Reset the references coutner of the PTCB to initial value
   ptcb->refcount=1;
+  retval = 0;
 
-  return 0;
+finish:
+  Mutex_Unlock(&proc_table_lock);
+  return retval;
 }
 
 
@@ -183,6 +211,9 @@ int sys_ThreadDetach(Tid_t tid)
 void sys_ThreadExit(int exitval)
 {
   PTCB* ptcb = (PTCB*)sys_ThreadSelf();
+  PCB* curproc = CURPROC;
+
+  Mutex_Lock(&proc_table_lock);
 
   /* Mark the ptcb as exited and set the exit value upon the function parameter */
   ptcb->exited = 1;
@@ -191,8 +222,6 @@ void sys_ThreadExit(int exitval)
   /* Else the thread count of the PCB is reduced by 1 and the node corresponding to the ptcb of the thread terminated is deleted from the list of ptcbs */
   ptcb->tcb->owner_pcb->thread_count--;
 
-  PCB* curproc = CURPROC;
-
   //Only if the last thread of the PCB is exiting, the process will be terminated too
   if(CURPROC->thread_count == 0){
       /* Do all the other cleanup we want here, close files etc. */
@@ -201,13 +230,11 @@ void sys_ThreadExit(int exitval)
       curproc->args = NULL;
     }
 
-    /* Clean up FIDT */
-    for(int i=0;i<MAX_FILEID;i++) {
-      if(curproc->FIDT[i] != NULL) {
-       FCB_decref(curproc->FIDT[i]);
-        curproc->FIDT[i] = NULL;
-      }
-    }
+    /* Clean up FIDT. Closing a stream may block, so this is done
+       without holding the process table lock. */
+    Mutex_Unlock(&proc_table_lock);
+    FCB_close_table(curproc);
+    Mutex_Lock(&proc_table_lock);
 
     /* Reparent any children of the exiting process to the 
        initial task */
@@ -239,7 +266,16 @@ void sys_ThreadExit(int exitval)
   }
 
   kernel_broadcast(& ptcb->exit_cv);
-  /* Release the kernel for future use */
-  kernel_sleep(EXITED, SCHED_USER);
+  /* Release the process table and exit */
+  sleep_releasing(EXITED, &proc_table_lock, SCHED_USER, NO_TIMEOUT);
 }
 
+
+int sys_GetThreadPoolStats(thread_pool_stats* stats)
+{
+  if(stats == NULL)
+    return -1;
+
+  get_thread_pool_stats(stats);
+  return 0;
+}
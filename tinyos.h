@@ -72,11 +72,13 @@ typedef uintptr_t Tid_t;
     mutexes are suitable for use in user-space, as well as in the implementation 
     of the kernel.
 
+    A mutex is a single word, which holds the owner of the mutex when it is locked.
+
     @see Mutex_Lock
     @see Mutex_Unlock
     @see MUTEX_INIT
 */
-typedef char Mutex;
+typedef uintptr_t Mutex;
 
 /**
   @brief This macro is used to initialize mutexes. 
@@ -92,7 +94,8 @@ typedef char Mutex;
 /** @brief Lock a mutex.
 
   Lock a mutex, by waiting if necessary, as long as it takes. In user-space and
-  in kernel-space (preemptive domain), the locking will yield after spinning for a few hundred times.
+  in kernel-space (preemptive domain), the locking will spin while the owner of the mutex runs
+  on another core, and otherwise it will put the thread to sleep until the mutex is unlocked.
   In scheduler space (non-preemptive domain), the mutex lock operation is pure spinlock.
 
   @see Mutex
@@ -103,7 +106,8 @@ void Mutex_Lock(Mutex*);
 
 /** @brief Unlock a mutex that you locked. 
   
-    This operation is non-blocking.
+    This operation is non-blocking. If threads are sleeping on the mutex, one of them
+    is woken up.
     @see Mutex
     @see Mutex_Lock
 */
@@ -179,6 +183,20 @@ int Cond_Wait(Mutex* mx, CondVar* cv);
   */
 int Cond_TimedWait(Mutex* mx, CondVar* cv, timeout_t timeout);
 
+/** @brief Wait on a condition variable, with a timeout in microseconds.
+
+  This is the same as @c Cond_TimedWait, except that the timeout is
+  given in microseconds.
+
+  @param mx The mutex to be unlocked as the thread sleeps.
+  @param cv The condition variable to sleep on.
+  @param usec The time in microseconds to wait blocked on the condition.
+  @returns 1 if this thread was woken up by signal/broadcast, 0 otherwise
+  @see Cond_TimedWait
+  @see GetTime
+  */
+int Cond_TimedWaitUsec(Mutex* mx, CondVar* cv, unsigned long usec);
+
 /** @brief Signal a condition variable. 
    
    This call wakes up exactly one thread sleeping on this condition
@@ -193,6 +211,9 @@ void Cond_Signal(CondVar*);
 
   Broadcast wakes up all threads sleeping on this condition variable.
   The calling thread is not preempted by the awoken threads.
+  If the mutex of the waiters is locked, as when the caller holds it, the
+  waiters are moved to sleep on the mutex, and they are woken up one at a time,
+  as the mutex is unlocked.
 
   @see Cond_Wait
   @see Cond_Signal
@@ -239,6 +260,61 @@ typedef int (*Task)(int, void*);
 Pid_t Exec(Task task, int argl, void* args);
 
 
+/** @brief The smallest stack size accepted in @c thread_attr. */
+#define THREAD_MIN_STACK_SIZE (8*1024)
+
+/** @brief The largest stack size accepted in @c thread_attr. */
+#define THREAD_MAX_STACK_SIZE (64*1024*1024)
+
+/** @brief The number of thread priority levels. 
+
+  Priorities range from 0 (lowest) to @c THREAD_PRIORITY_LEVELS-1 (highest).
+  */
+#define THREAD_PRIORITY_LEVELS 30
+
+/** @brief Designates the default initial priority in @c thread_attr. */
+#define THREAD_DEFAULT_PRIORITY (-1)
+
+/** @brief Attributes for creating a new thread.
+
+  @see CreateThreadEx
+  @see ExecEx
+  */
+typedef struct thread_attr
+{
+  unsigned int stack_size; /**< @brief The stack size in bytes, or 0 for the
+                              default. It is rounded up to whole pages. */
+  int priority;            /**< @brief The initial priority, or 
+                              @c THREAD_DEFAULT_PRIORITY */
+} thread_attr;
+
+/** @brief Initializer for a @c thread_attr with the default values. */
+#define THREAD_ATTR_INIT ((thread_attr){ .stack_size = 0, .priority = THREAD_DEFAULT_PRIORITY })
+
+
+/** @brief Create a new process, with the given attributes for its main thread.
+
+  This call is the same as @c Exec, except that the main thread of the 
+  new process is created with the given attributes. If @c attr is NULL,
+  the default attributes are used.
+
+  @param task the main function  of the new process
+  @param argl the length of byte array @c args
+  @param args the byte array copied as argument to `task`
+  @param attr the attributes of the main thread, or NULL
+  @return On success, the pid of the new process is returned.
+    On error, NOPROC is returned.
+     Possible errors:
+   -  The maximum number of processes has been reached.
+   -  The stack size is not 0 and outside the range 
+      [@c THREAD_MIN_STACK_SIZE, @c THREAD_MAX_STACK_SIZE].
+   -  The priority is not @c THREAD_DEFAULT_PRIORITY and outside the range 
+      [0, @c THREAD_PRIORITY_LEVELS).
+  @see Exec
+  */
+Pid_t ExecEx(Task task, int argl, void* args, const thread_attr* attr);
+
+
 /** @brief Exit the current process.
 
   When this function is called by a process thread, the process terminates
@@ -289,6 +365,14 @@ Pid_t GetPid(void);
  */
 Pid_t GetPPid(void);
 
+/** @brief Return the current time.
+
+  The time is returned in microseconds, from a monotonic clock which
+  starts at some unspecified point in the past. Therefore, it is only
+  useful for measuring time intervals.
+  */
+unsigned long GetTime(void);
+
 /*******************************************
  *
  * Threads
@@ -317,6 +401,27 @@ Pid_t GetPPid(void);
   */
 Tid_t CreateThread(Task task, int argl, void* args);
 
+/** 
+  @brief Create a new thread in the current process, with the given attributes.
+
+  This call is the same as @c CreateThread, except that the new thread
+  is created with the stack size and initial priority given in @c attr.
+  If @c attr is NULL, the default attributes are used.
+
+  @param task a function to execute
+  @param argl the first argument of @c task
+  @param args the second argument of @c task
+  @param attr the attributes of the new thread, or NULL
+  @returns the tid of the new thread, or @c NOTHREAD on error. Possible errors are:
+    - The stack size is not 0 and outside the range 
+      [@c THREAD_MIN_STACK_SIZE, @c THREAD_MAX_STACK_SIZE].
+    - The priority is not @c THREAD_DEFAULT_PRIORITY and outside the range 
+      [0, @c THREAD_PRIORITY_LEVELS).
+  @see CreateThread
+  @see thread_attr
+  */
+Tid_t CreateThreadEx(Task task, int argl, void* args, const thread_attr* attr);
+
 /**
   @brief Return the Tid of the current thread.
  */
@@ -513,9 +618,9 @@ typedef struct pipe_s {
 	@brief Construct and return a pipe.
 
 	A pipe is a one-directional buffer accessed via two file ids,
-	one for each end of the buffer. The size of the buffer is 
-	implementation-specific, but can be assumed to be between 4 and 16 
-	kbytes. 
+	one for each end of the buffer. The buffer starts small and grows
+	on demand, up to a capacity of 128 kbytes by default (see 
+	@c PipeSetCapacity). 
 
 	Once a pipe is constructed, it remains operational as long as both
 	ends are open. If the read end is closed, the write end becomes 
@@ -529,6 +634,70 @@ typedef struct pipe_s {
 */
 int Pipe(pipe_t* pipe);
 
+
+/**
+	@brief Set the capacity of a pipe.
+
+	The capacity is the maximum number of bytes the pipe can buffer; 
+	once it is reached, @c Write blocks until a reader makes room.
+	The requested size is rounded up to a power of 2, and to at least 
+	4 kbytes. Either end of the pipe may be passed.
+
+	@param fid a file id for either end of a pipe.
+	@param size the requested capacity, in bytes.
+	@returns the new capacity on success, or -1 on error. Possible reasons 
+	    for error:
+		- the file id is invalid, or is not a pipe end.
+		- the capacity would exceed 1 Mbyte.
+		- the pipe currently holds more data than the capacity.
+*/
+int PipeSetCapacity(Fid_t fid, unsigned int size);
+
+
+/**
+	@brief Move data from one stream to another, through a pipe.
+
+	At least one of the streams must be a pipe: either @c in is the read end
+	of a pipe, or @c out is the write end of a pipe, or both. The data moves
+	directly between the pipe buffer and the other stream (or the other pipe 
+	buffer), without being copied into a buffer in between. 
+
+	The call blocks like a @c Read from @c in, when it is an empty pipe,
+	and like a @c Write to @c out, when it is a full pipe. It may move less
+	than @c size bytes.
+
+	@param in the file id to read from.
+	@param out the file id to write to.
+	@param size the largest number of bytes to move.
+	@returns the number of bytes moved, 0 at the end of data in @c in, 
+	    or -1 on error. Possible reasons for error:
+		- a file id is invalid, or cannot be read (in) or written (out).
+		- neither stream is a pipe, or both are the same pipe.
+		- the read end of the @c out pipe is closed.
+		- @c size is 0.
+*/
+int Splice(Fid_t in, Fid_t out, unsigned int size);
+
+
+/**
+	@brief Copy data from one pipe to another, without consuming it.
+
+	Up to @c size bytes at the front of the @c in pipe are copied to the 
+	@c out pipe, and remain available for reading from @c in. The call 
+	blocks like @c Splice.
+
+	@param in the read end of a pipe.
+	@param out the write end of another pipe.
+	@param size the largest number of bytes to copy.
+	@returns the number of bytes copied, 0 at the end of data in @c in,
+	    or -1 on error. Possible reasons for error:
+		- a file id is invalid, or is not the proper end of a pipe.
+		- both file ids are ends of the same pipe.
+		- the read end of the @c out pipe is closed.
+		- @c size is 0.
+*/
+int Tee(Fid_t in, Fid_t out, unsigned int size);
+
 /*******************************************
  *
  * Sockets (local)
@@ -758,6 +927,36 @@ typedef struct procinfo
 Fid_t OpenInfo();
 
 
+/**
+	@brief Statistics of the thread block pool.
+
+	A thread block is the memory of a thread, together with its stack. 
+	The blocks of exited threads are kept in a pool, and reused by the 
+	threads created later.
+
+	@see GetThreadPoolStats
+  */
+typedef struct thread_pool_stats
+{
+	unsigned long hits; /**< @brief Thread blocks reused from the pool */
+	unsigned long misses; /**< @brief Thread blocks obtained from the host allocator */
+	unsigned int cached; /**< @brief Free blocks currently held in the core caches */
+	unsigned int depot; /**< @brief Free blocks currently held in the global depot */
+} thread_pool_stats;
+
+
+/**
+	@brief Get the statistics of the thread block pool.
+
+	The counters are system-wide, and are only approximate while threads 
+	are being created or are exiting.
+
+	@param stats the object to fill
+	@returns 0 on success, or -1 if @c stats is NULL.
+ */
+int GetThreadPoolStats(thread_pool_stats* stats);
+
+
 
 
 /*******************************************
@@ -779,6 +978,19 @@ Fid_t OpenInfo();
 void boot(unsigned int ncores, unsigned int terminals, Task boot_task, int argl, void* args);
 
 
+/** @brief Boot tinyos3, pinning the cpu cores to host cpus.
+
+   This is the same as @c boot, except that core @f$ c @f$ of the simulated 
+   computer is pinned to host cpu @c cpumap[c] (or not pinned, if it is negative).
+   If @c cpumap is @c NULL, the pinning is determined by the @c TINYOS_AFFINITY 
+   environment variable.
+
+   @see vm_boot_ex
+   */
+void boot_ex(unsigned int ncores, unsigned int terminals, const int* cpumap, 
+  Task boot_task, int argl, void* args);
+
+
 /** @} */
 
 #endif
@@ -5,6 +5,7 @@
 #include <time.h>
 #include <math.h>
 #include <setjmp.h>
+#include <sched.h>
 
 #include "util.h"
 #include "symposium.h"
@@ -69,6 +70,36 @@ BARE_TEST(test_boot,
 }
 
 
+BARE_TEST(test_boot_affinity,
+	"Test that boot_ex(...) can boot more than 32 cores, and pins\n"
+	"them to the given host cpus.")
+{
+	/* Pin all cores to the first host cpu we may run on */
+	cpu_set_t allowed;
+	ASSERT(sched_getaffinity(0, sizeof(allowed), &allowed)==0);
+	int cpu = 0;
+	while(! CPU_ISSET(cpu, &allowed)) cpu++;
+
+	const uint ncores = 40;
+	int cpumap[ncores];
+	for(uint c=0; c<ncores; c++) cpumap[c] = cpu;
+
+	uint booted_cores = 0;
+	int booted_cpu = -1;
+	int boot_task(int argl, void* args)
+	{
+		booted_cores = cpu_cores();
+		booted_cpu = sched_getcpu();
+		return 0;
+	}
+
+	boot_ex(ncores, 0, cpumap, boot_task, 0, NULL);
+
+	ASSERT(booted_cores == ncores);
+	ASSERT(booted_cpu == cpu);
+}
+
+
 
 
 /*********************************************
@@ -214,6 +245,36 @@ BOOT_TEST(test_exec_copies_arguments,
 }
 
 
+BOOT_TEST(test_execex_with_attributes,
+	"Test that ExecEx creates a process whose main thread has the given attributes, "
+	"and fails on illegal attributes."
+	)
+{
+	int child(int argl, void* args)
+	{
+		volatile char frame[256*1024];
+		frame[0] = 1;
+		frame[sizeof(frame)-1] = 1;
+		return frame[0] + frame[sizeof(frame)-1];
+	}
+
+	thread_attr attr = { .stack_size = 512*1024, .priority = 0 };
+	Pid_t cpid;
+	int status;
+	ASSERT((cpid = ExecEx(child, 0, NULL, &attr))!=NOPROC);
+	ASSERT(WaitChild(cpid, &status)==cpid);
+	ASSERT(status==2);
+
+	attr = THREAD_ATTR_INIT;
+	attr.stack_size = THREAD_MAX_STACK_SIZE + 1;
+	ASSERT(ExecEx(child, 0, NULL, &attr)==NOPROC);
+	attr = THREAD_ATTR_INIT;
+	attr.priority = THREAD_PRIORITY_LEVELS;
+	ASSERT(ExecEx(child, 0, NULL, &attr)==NOPROC);
+	return 0;
+}
+
+
 BOOT_TEST(test_wait_for_any_child, 
 	"Test WaitChild when called to wait on any child."
 	)
@@ -476,6 +537,104 @@ BOOT_TEST(test_cond_timedwait_broadcast,
 }
 
 
+BOOT_TEST(test_get_time,
+	"Test that GetTime returns a monotonic time in microseconds."
+	)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	unsigned long t1 = GetTime();
+	ASSERT(GetTime() >= t1);
+
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 20);
+	Mutex_Unlock(&mx);
+
+	unsigned long t2 = GetTime();
+	ASSERT(t2 - t1 >= 20000);
+	/* Allow a large error */
+	ASSERT(t2 - t1 < 1000000);
+	return 0;
+}
+
+
+BOOT_TEST(test_cond_timedwait_usec,
+	"Test that timed waits on a condition variable support sub-millisecond timeouts."
+	)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	Mutex_Lock(&mx);
+	for(unsigned long usec=200; usec<1000; usec+=200) {
+		unsigned long t1 = GetTime();
+		ASSERT(Cond_TimedWaitUsec(&mx, &cv, usec)==0);
+		unsigned long Dt = GetTime() - t1;
+
+		/* The wait must not be rounded up to the scheduler quantum (10 msec) */
+		ASSERT(Dt >= usec);
+		ASSERT(Dt < 10000);
+	}
+	Mutex_Unlock(&mx);
+	return 0;
+}
+
+
+BOOT_TEST(test_cond_broadcast,
+	"Test that Cond_Broadcast wakes up all waiters, timed or not, when it is called\n"
+	"with the mutex locked, and they all get the mutex one after the other."
+	)
+{
+	const unsigned int N=10;
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	CondVar arrived = COND_INIT;
+	unsigned int waiting = 0, woken = 0, inside = 0;
+	int go = 0;
+	Tid_t tids[N];
+
+	int waiter(int argl, void* args) {
+		Mutex_Lock(&mx);
+		waiting++;
+		Cond_Signal(&arrived);
+		while(! go) {
+			if(argl % 2)
+				Cond_TimedWait(&mx, &cv, 10000);
+			else
+				Cond_Wait(&mx, &cv);
+		}
+		ASSERT(inside++ == 0);
+		woken++;
+		inside--;
+		Mutex_Unlock(&mx);
+		return 0;
+	}
+
+	for(unsigned int i=0; i<N; i++) {
+		tids[i] = CreateThread(waiter, i, NULL);
+		assert(tids[i]!=NOTHREAD);
+	}
+
+	Mutex_Lock(&mx);
+	while(waiting < N)
+		Cond_Wait(&mx, &arrived);
+	go = 1;
+	Cond_Broadcast(&cv);
+	/* Hold the mutex for a while, the waiters must wait for it */
+	Mutex smx = MUTEX_INIT;
+	Mutex_Lock(&smx);
+	Cond_TimedWaitUsec(&smx, &arrived, 2000);
+	Mutex_Unlock(&smx);
+	Mutex_Unlock(&mx);
+
+	for(unsigned int i=0; i<N; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	ASSERT(woken == N);
+	return 0;
+}
+
+
 
 /*********************************************
  *
@@ -871,11 +1030,13 @@ TEST_SUITE(basic_tests,
 	)
 {
 	&test_boot,
+	&test_boot_affinity,
 	&test_pid_of_init_is_one,
 	&test_waitchild_error_on_nonchild,
 	&test_waitchild_error_on_invalid_pid,
 	&test_exec_getpid_wait,
 	&test_exec_copies_arguments,
+	&test_execex_with_attributes,
 	&test_exit_returns_status,
 	&test_main_return_returns_status,
 	&test_wait_for_any_child,
@@ -883,6 +1044,9 @@ TEST_SUITE(basic_tests,
 	&test_cond_timedwait_timeout,
 	&test_cond_timedwait_signal,
 	&test_cond_timedwait_broadcast,
+	&test_get_time,
+	&test_cond_timedwait_usec,
+	&test_cond_broadcast,
 	&test_null_device,
 	&test_get_terminals,
 	&test_open_terminals,
@@ -994,6 +1158,57 @@ BOOT_TEST(test_create_join_thread,
 	return 0;
 }
 
+BOOT_TEST(test_create_thread_ex,
+	"Test that CreateThreadEx creates threads with the given stack size and "
+	"priority, and fails on illegal attributes."
+	)
+{
+	barrier B = BARRIER_INIT;
+
+	/* Use about 'depth' kbytes of stack */
+	int use_stack(int depth) {
+		volatile char frame[1024];
+		frame[0] = 1;
+		return (depth > 1) ? use_stack(depth-1) + frame[0] : frame[0];
+	}
+
+	int task(int argl, void* args) {
+		/* Exit only after all threads are created */
+		BarrierSync(&B, 4);
+		return use_stack(argl);
+	}
+
+	thread_attr small = { .stack_size = THREAD_MIN_STACK_SIZE, .priority = 0 };
+	thread_attr large = { .stack_size = 1024*1024, .priority = THREAD_PRIORITY_LEVELS-1 };
+	thread_attr dflt = THREAD_ATTR_INIT;
+
+	int depth[3] = { 1, 768, 16 };
+	Tid_t t[3];
+	t[0] = CreateThreadEx(task, depth[0], NULL, &small);
+	t[1] = CreateThreadEx(task, depth[1], NULL, &large);
+	t[2] = CreateThreadEx(task, depth[2], NULL, &dflt);
+	BarrierSync(&B, 4);
+
+	for(int i=0; i<3; i++) {
+		int exitval;
+		ASSERT(t[i]!=NOTHREAD);
+		ASSERT(ThreadJoin(t[i], &exitval)==0);
+		ASSERT(exitval==depth[i]);
+	}
+
+	thread_attr bad = THREAD_ATTR_INIT;
+	bad.stack_size = THREAD_MIN_STACK_SIZE - 1;
+	ASSERT(CreateThreadEx(task, 1, NULL, &bad)==NOTHREAD);
+	bad.stack_size = THREAD_MAX_STACK_SIZE + 1;
+	ASSERT(CreateThreadEx(task, 1, NULL, &bad)==NOTHREAD);
+	bad = THREAD_ATTR_INIT;
+	bad.priority = THREAD_PRIORITY_LEVELS;
+	ASSERT(CreateThreadEx(task, 1, NULL, &bad)==NOTHREAD);
+	bad.priority = -2;
+	ASSERT(CreateThreadEx(task, 1, NULL, &bad)==NOTHREAD);
+	return 0;
+}
+
 BOOT_TEST(test_detach_self,
 	"Test that a thread can detach itself")
 {
@@ -1290,6 +1505,123 @@ BOOT_TEST(test_cyclic_joins,
 }
 
 
+BOOT_TEST(test_mutex_contention,
+	"Test that a heavily contended mutex, held across sleeps, provides mutual exclusion")
+{
+	const unsigned int N=8;
+	const unsigned int LOOPS=2000;
+	Mutex mx = MUTEX_INIT;
+	unsigned int counter = 0;
+	barrier B = BARRIER_INIT;
+	Tid_t tids[N];
+
+	int contend_thread(int argl, void* args) {
+		Mutex smx = MUTEX_INIT;
+		CondVar scv = COND_INIT;
+
+		BarrierSync(&B, N);
+		for(unsigned int i=0; i<LOOPS; i++) {
+			Mutex_Lock(&mx);
+			unsigned int c = counter;
+			if(i % 500 == 0) {
+				/* sleep holding the mutex, so that the others park */
+				Mutex_Lock(&smx);
+				Cond_TimedWaitUsec(&smx, &scv, 2000);
+				Mutex_Unlock(&smx);
+			}
+			counter = c+1;
+			Mutex_Unlock(&mx);
+		}
+		return 0;
+	}
+
+	for(unsigned int i=0; i<N; i++) {
+		tids[i] = CreateThread(contend_thread, i, NULL);
+		assert(tids[i]!=NOTHREAD);
+	}
+	for(unsigned int i=0; i<N; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	ASSERT(counter == N*LOOPS);
+	return 0;
+}
+
+
+BOOT_TEST(test_mutex_priorities,
+	"Test that threads of different priorities, contending for a mutex, are excluded and all finish")
+{
+	const unsigned int N=6;
+	const unsigned int LOOPS=1000;
+	Mutex mx = MUTEX_INIT;
+	unsigned int counter = 0;
+	barrier B = BARRIER_INIT;
+	Tid_t tids[N];
+
+	int contend_thread(int argl, void* args) {
+		Mutex smx = MUTEX_INIT;
+		CondVar scv = COND_INIT;
+
+		BarrierSync(&B, N);
+		for(unsigned int i=0; i<LOOPS; i++) {
+			Mutex_Lock(&mx);
+			unsigned int c = counter;
+			if(i % 250 == argl) {
+				/* the holder sleeps, and the waiters donate their priority to it */
+				Mutex_Lock(&smx);
+				Cond_TimedWaitUsec(&smx, &scv, 2000);
+				Mutex_Unlock(&smx);
+			}
+			counter = c+1;
+			Mutex_Unlock(&mx);
+		}
+		return 0;
+	}
+
+	for(unsigned int i=0; i<N; i++) {
+		thread_attr attr = THREAD_ATTR_INIT;
+		attr.priority = i * (THREAD_PRIORITY_LEVELS-1) / (N-1);
+		tids[i] = CreateThreadEx(contend_thread, i, NULL, &attr);
+		assert(tids[i]!=NOTHREAD);
+	}
+	for(unsigned int i=0; i<N; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	ASSERT(counter == N*LOOPS);
+	return 0;
+}
+
+
+BOOT_TEST(test_thread_pool_stats,
+	"Test that the thread block pool counts the blocks of new threads, and reuses those of exited ones.")
+{
+	int null_thread(int argl, void* args) { return 0; }
+
+	thread_pool_stats before, after;
+	ASSERT(GetThreadPoolStats(NULL)==-1);
+	ASSERT(GetThreadPoolStats(&before)==0);
+
+	/* The burst is spread over many processes, each creating one thread,
+	   since CreateThread checks that no thread of the process has exited */
+	int spawner(int argl, void* args) {
+		Tid_t tid = CreateThread(null_thread, 0, NULL);
+		ASSERT(tid!=NOTHREAD);
+		ASSERT(ThreadJoin(tid, NULL)==0);
+		return 0;
+	}
+
+	const int N = 100;
+	for(int i=0;i<N;i++) {
+		ASSERT(Exec(spawner, 0, NULL)!=NOPROC);
+		ASSERT(WaitChild(NOPROC, NULL)!=NOPROC);
+	}
+
+	ASSERT(GetThreadPoolStats(&after)==0);
+	ASSERT(after.hits + after.misses >= before.hits + before.misses + 2*N);
+	ASSERT(after.hits > before.hits);
+	return 0;
+}
+
+
 TEST_SUITE(thread_tests, 
 	"A suite of tests for threads."
 	)
@@ -1303,11 +1635,15 @@ TEST_SUITE(thread_tests,
 	&test_detach_main_thread,
 	&test_detach_after_join,
 	&test_create_join_thread,
+	&test_create_thread_ex,
 	&test_join_many_threads,
 	&test_exit_many_threads,
 	&test_main_exit_cleanup,
 	&test_noexit_cleanup,
 	&test_cyclic_joins,
+	&test_mutex_contention,
+	&test_mutex_priorities,
+	&test_thread_pool_stats,
 	NULL
 };
 
@@ -1406,6 +1742,273 @@ BOOT_TEST(test_pipe_close_writer,
 }
 
 
+BOOT_TEST(test_pipe_read_returns_available,
+	"Test that a read from a pipe returns the data available, without waiting to fill the buffer,\n"
+	"also when the data wraps around the end of the pipe buffer."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	static char buffer[100000];
+	for(int i=0; i<4; i++) {
+		memset(buffer, 'a'+i, sizeof(buffer));
+		ASSERT(Write(pipe.write, buffer, sizeof(buffer))==sizeof(buffer));
+		memset(buffer, 0, sizeof(buffer));
+		ASSERT(Read(pipe.read, buffer, sizeof(buffer)+1000)==sizeof(buffer));
+		for(int j=0; j<sizeof(buffer); j++)
+			ASSERT(buffer[j]=='a'+i);
+	}
+
+	ASSERT(Write(pipe.write, "Hello", 5)==5);
+	ASSERT(Read(pipe.read, buffer, 100)==5);
+	ASSERT(memcmp(buffer, "Hello", 5)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_set_capacity,
+	"Test that the capacity of a pipe can be changed, but not below the data it holds."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	ASSERT(PipeSetCapacity(pipe.write, 5000)==8192);
+
+	static char buffer[8192];
+	memset(buffer, 'x', sizeof(buffer));
+	ASSERT(Write(pipe.write, buffer, sizeof(buffer))==sizeof(buffer));
+	ASSERT(PipeSetCapacity(pipe.read, 4096)==-1);
+
+	memset(buffer, 0, sizeof(buffer));
+	ASSERT(Read(pipe.read, buffer, sizeof(buffer))==sizeof(buffer));
+	for(int j=0; j<sizeof(buffer); j++)
+		ASSERT(buffer[j]=='x');
+	ASSERT(PipeSetCapacity(pipe.read, 4096)==4096);
+
+	ASSERT(PipeSetCapacity(pipe.write, 1<<21)==-1);
+	ASSERT(PipeSetCapacity(MAX_FILEID, 4096)==-1);
+	Fid_t fid = OpenNull();
+	ASSERT(PipeSetCapacity(fid, 4096)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_many_readers_writers,
+	"Test that no wakeups are lost when many threads block on both ends of a small pipe."
+	)
+{
+	const unsigned int N=4, BYTES=40000;
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	ASSERT(PipeSetCapacity(pipe.write, 4096)==4096);
+
+	int writer_thread(int argl, void* args) {
+		char buffer[300];
+		memset(buffer, 'a'+argl, sizeof(buffer));
+		for(unsigned int nbytes=0; nbytes<BYTES; ) {
+			unsigned int n = 1 + (nbytes % sizeof(buffer));
+			if(n > BYTES-nbytes) n = BYTES-nbytes;
+			ASSERT(Write(pipe.write, buffer, n)==n);
+			nbytes += n;
+		}
+		return 0;
+	}
+
+	int reader_thread(int argl, void* args) {
+		char buffer[700];
+		int nbytes = 0, rc;
+		while((rc = Read(pipe.read, buffer, 1 + (nbytes+argl) % sizeof(buffer))) > 0)
+			nbytes += rc;
+		ASSERT(rc==0);
+		return nbytes;
+	}
+
+	Tid_t tids[2*N];
+	for(unsigned int i=0; i<N; i++) {
+		tids[i] = CreateThread(reader_thread, i, NULL);
+		tids[N+i] = CreateThread(writer_thread, i, NULL);
+		assert(tids[i]!=NOTHREAD && tids[N+i]!=NOTHREAD);
+	}
+	for(unsigned int i=N; i<2*N; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	Close(pipe.write);
+
+	int total = 0;
+	for(unsigned int i=0; i<N; i++) {
+		int nbytes;
+		ASSERT(ThreadJoin(tids[i], &nbytes)==0);
+		total += nbytes;
+	}
+	ASSERT(total == N*BYTES);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_stream_order,
+	"Test that a stream of bytes from a single writer to a single reader arrives intact and in order."
+	)
+{
+	const unsigned int BYTES=2000000;
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	int writer_thread(int argl, void* args) {
+		char buffer[5000];
+		for(unsigned int nbytes=0; nbytes<BYTES; ) {
+			unsigned int n = 1 + (nbytes*7 % sizeof(buffer));
+			if(n > BYTES-nbytes) n = BYTES-nbytes;
+			for(unsigned int i=0; i<n; i++)
+				buffer[i] = (char)((nbytes+i) % 251);
+			ASSERT(Write(pipe.write, buffer, n)==n);
+			nbytes += n;
+		}
+		Close(pipe.write);
+		return 0;
+	}
+
+	Tid_t tid = CreateThread(writer_thread, 0, NULL);
+	ASSERT(tid!=NOTHREAD);
+
+	static char buffer[3000];
+	unsigned int nbytes = 0;
+	int rc;
+	while((rc = Read(pipe.read, buffer, 1 + (nbytes*13 % sizeof(buffer)))) > 0) {
+		for(int i=0; i<rc; i++)
+			ASSERT(buffer[i] == (char)((nbytes+i) % 251));
+		nbytes += rc;
+	}
+	ASSERT(rc==0);
+	ASSERT(nbytes == BYTES);
+	ASSERT(ThreadJoin(tid, NULL)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_splice_tee,
+	"Test that Splice moves, and Tee copies, data between pipes and other streams."
+	)
+{
+	pipe_t p1, p2;
+	ASSERT(Pipe(&p1)==0);
+	ASSERT(Pipe(&p2)==0);
+	Fid_t null = OpenNull();
+	ASSERT(null!=NOFILE);
+
+	char buffer[100];
+	ASSERT(Write(p1.write, "Hello world", 12)==12);
+	ASSERT(Tee(p1.read, p2.write, 100)==12);
+	ASSERT(Splice(p1.read, p2.write, 6)==6);
+	ASSERT(Read(p2.read, buffer, 100)==18);
+	ASSERT(memcmp(buffer, "Hello world\0Hello ", 18)==0);
+
+	/* To and from a device */
+	ASSERT(Splice(p1.read, null, 100)==6);
+	ASSERT(Splice(null, p1.write, 10)==10);
+	ASSERT(Read(p1.read, buffer, 100)==10);
+	for(int i=0; i<10; i++)
+		ASSERT(buffer[i]==0);
+
+	/* Errors */
+	ASSERT(Splice(p1.read, p1.write, 10)==-1);
+	ASSERT(Tee(p1.read, p1.write, 10)==-1);
+	ASSERT(Splice(null, null, 10)==-1);
+	ASSERT(Tee(null, p2.write, 10)==-1);
+	ASSERT(Splice(p2.write, p1.write, 10)==-1);
+	ASSERT(Splice(p1.read, p2.write, 0)==-1);
+
+	/* End of data, and closed reader */
+	Close(p1.write);
+	ASSERT(Splice(p1.read, p2.write, 10)==0);
+	ASSERT(Tee(p1.read, p2.write, 10)==0);
+	Close(p2.read);
+	ASSERT(Splice(null, p2.write, 10)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_splice_relay,
+	"Test that a relay thread splicing one pipe into another passes a stream intact and in order."
+	)
+{
+	const unsigned int BYTES=999000;	/* a multiple of the writer's buffer */
+	pipe_t p1, p2;
+	ASSERT(Pipe(&p1)==0);
+	ASSERT(Pipe(&p2)==0);
+
+	int writer_thread(int argl, void* args) {
+		char buffer[3000];
+		for(unsigned int nbytes=0; nbytes<BYTES; nbytes += sizeof(buffer)) {
+			for(unsigned int i=0; i<sizeof(buffer); i++)
+				buffer[i] = (char)((nbytes+i) % 251);
+			ASSERT(Write(p1.write, buffer, sizeof(buffer))==sizeof(buffer));
+		}
+		Close(p1.write);
+		return 0;
+	}
+
+	int relay_thread(int argl, void* args) {
+		int rc;
+		while((rc = Splice(p1.read, p2.write, 5000)) > 0);
+		ASSERT(rc==0);
+		Close(p2.write);
+		return 0;
+	}
+
+	Tid_t wtid = CreateThread(writer_thread, 0, NULL);
+	Tid_t rtid = CreateThread(relay_thread, 0, NULL);
+	ASSERT(wtid!=NOTHREAD && rtid!=NOTHREAD);
+
+	static char buffer[7000];
+	unsigned int nbytes = 0;
+	int rc;
+	while((rc = Read(p2.read, buffer, sizeof(buffer))) > 0) {
+		for(int i=0; i<rc; i++)
+			ASSERT(buffer[i] == (char)((nbytes+i) % 251));
+		nbytes += rc;
+	}
+	ASSERT(nbytes == BYTES);
+	ASSERT(ThreadJoin(wtid, NULL)==0);
+	ASSERT(ThreadJoin(rtid, NULL)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_splice_unlocked,
+	"Test that a Splice blocked in a device Read does not block the reader of the pipe.",
+	.minimum_terminals = 1
+	)
+{
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+	ASSERT(Write(p.write, "abc", 3)==3);
+
+	int splice_thread(int argl, void* args) {
+		ASSERT(Splice(fterm, p.write, 10)==2);
+		return 0;
+	}
+
+	Tid_t tid = CreateThread(splice_thread, 0, NULL);
+	ASSERT(tid!=NOTHREAD);
+
+	/* Give the Splice time to block in the terminal */
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 100);
+	Mutex_Unlock(&mx);
+
+	checked_read(p.read, "abc");
+	sendme(0, "xy");
+	checked_read(p.read, "xy");
+	ASSERT(ThreadJoin(tid, NULL)==0);
+	return 0;
+}
+
+
 /* Takes one integer argument, writes that many bytes to stdout.
  */
 int data_producer(int argl, void* args)
@@ -1525,6 +2128,46 @@ BOOT_TEST(test_pipe_multi_producer,
 }
 
 
+BOOT_TEST(test_pipes_in_parallel,
+	"Test that independent pipes can transfer data at the same time, by 4 pairs\n"
+	"of producers and consumers sending 1Mbyte each, over 4 different pipes."
+	)
+{
+	int N = 1000000;
+
+	for(int p=0; p<4; p++) {
+		pipe_t pipe;
+		ASSERT(Pipe(&pipe)==0);
+
+		/* Make pipe.read be 0 and pipe.write be 1, as in test_pipe_single_producer */
+		if(pipe.read != 0) {
+			if(pipe.write==0) {
+				Fid_t fid = OpenNull();
+				assert(fid!=NOFILE);
+				Dup2(0, fid);
+				pipe.write = fid;
+			}
+			Dup2(pipe.read, 0);
+			Close(pipe.read);
+		}
+		if(pipe.write!=1)  {
+			Dup2(pipe.write, 1);
+			Close(pipe.write);
+		}
+
+		ASSERT(Exec(data_consumer, sizeof(N), &N)!=NOPROC);
+		ASSERT(Exec(data_producer, sizeof(N), &N)!=NOPROC);
+
+		Close(0);
+		Close(1);
+	}
+
+	for(int p=0; p<8; p++)
+		ASSERT(WaitChild(NOPROC,NULL)!=NOPROC);
+	return 0;
+}
+
+
 TEST_SUITE(pipe_tests,
 	"A suite of tests for pipes. We are focusing on correctness, not performance."
 	)
@@ -1533,8 +2176,16 @@ TEST_SUITE(pipe_tests,
 	&test_pipe_fails_on_exhausted_fid,
 	&test_pipe_close_reader,
 	&test_pipe_close_writer,
+	&test_pipe_read_returns_available,
+	&test_pipe_set_capacity,
+	&test_pipe_many_readers_writers,
+	&test_pipe_stream_order,
+	&test_pipe_splice_tee,
+	&test_pipe_splice_relay,
+	&test_pipe_splice_unlocked,
 	&test_pipe_single_producer,
 	&test_pipe_multi_producer,
+	&test_pipes_in_parallel,
 	NULL
 };
 